@@ -0,0 +1,61 @@
+//
+//  CameraRayGenerator.h
+//  RayTracerXcode
+//
+
+#ifndef CameraRayGenerator_h
+#define CameraRayGenerator_h
+
+#include "ExternalLibrary/scene.h"
+#include "Sampling.h"
+#include <math.h>
+
+//Generates primary rays from the camera
+//The camera basis and the image plane are computed once per frame by Init(),
+//a ray then only costs a few multiply-adds and a normalization
+class CameraRayGenerator
+{
+private:
+    Point3 position;
+    Point3 right, up;           //Orthonormal camera basis, scaled by the lens radius for lens sampling
+    Point3 imageOrigin;         //Top left corner of the image on the focal plane
+    Point3 pixelDX, pixelDY;    //Size of a pixel on the focal plane along x and y
+
+public:
+    void Init(const Camera &cam)
+    {
+        Point3 w = cam.dir.GetNormalized();
+        Point3 u = w.Cross(cam.up).GetNormalized();
+        Point3 v = u.Cross(w);
+
+        float planeHeight = tan((cam.fov/2)*M_PI/180.0)*2*cam.focaldist;
+        float planeWidth = ((float)cam.imgWidth/(float)cam.imgHeight) * planeHeight;
+
+        position = cam.pos;
+        right = u * cam.dof;
+        up = v * cam.dof;
+        imageOrigin = cam.pos + w*cam.focaldist + v*(planeHeight/2) - u*(planeWidth/2);
+        pixelDX = u * (planeWidth/(float)cam.imgWidth);
+        pixelDY = -v * (planeHeight/(float)cam.imgHeight);
+    }
+
+    //pixelOffset: position inside the pixel, lensSample: uniform sample mapped to the lens disk
+    Ray GetRay(int x, int y, const Point2 &pixelOffset, const Point2 &lensSample) const
+    {
+        Point2 lens = SampleConcentricDisk(lensSample);
+        Point3 origin = position + right*lens.x + up*lens.y;
+        Point3 target = imageOrigin + pixelDX*(x + pixelOffset.x) + pixelDY*(y + pixelOffset.y);
+
+        return Ray(origin, (target - origin).GetNormalized());
+    }
+
+    //Generates n rays of the pixel, the iterations are independent so the loop can be vectorized
+    void GetRays(int x, int y, const Point2 *pixelOffsets, const Point2 *lensSamples, Ray *rays, int n) const
+    {
+        for (int i = 0; i < n; i++) {
+            rays[i] = GetRay(x, y, pixelOffsets[i], lensSamples[i]);
+        }
+    }
+};
+
+#endif /* CameraRayGenerator_h */
@@ -36,6 +36,16 @@
 #ifndef _CY_BVH_H_INCLUDED_
 #define _CY_BVH_H_INCLUDED_
 
+#include <vector>
+#include <algorithm>
+#include <future>
+#include <thread>
+
+#if !defined(CY_BVH_NO_SSE) && ( defined(__SSE__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 1 ) )
+# define _CY_BVH_SSE
+# include <xmmintrin.h>
+#endif
+
 //-------------------------------------------------------------------------------
 namespace cy {
 //-------------------------------------------------------------------------------
@@ -48,6 +58,14 @@ namespace cy {
 #define CY_BVH_MAX_ELEMENT_COUNT	(1<<CY_BVH_ELEMENT_COUNT_BITS)	//!< Determines the maximum number of elements in a node (8)
 #endif
 
+#ifndef CY_BVH_PARALLEL_BUILD_MIN_ELEMENTS
+#define CY_BVH_PARALLEL_BUILD_MIN_ELEMENTS	4096	//!< Nodes with at least this many elements build their subtrees and bins on multiple threads
+#endif
+
+#ifndef CY_BVH_SAH_BIN_COUNT
+#define CY_BVH_SAH_BIN_COUNT		16	//!< Number of bins per axis used by the binned SAH split
+#endif
+
 #define _CY_BVH_NODE_DATA_BITS		(sizeof(unsigned int)*8)
 #define _CY_BVH_ELEMENT_COUNT_MASK	((1<<CY_BVH_ELEMENT_COUNT_BITS)-1)
 #define _CY_BVH_LEAF_BIT_MASK		((unsigned int)1<<(_CY_BVH_NODE_DATA_BITS-1))
@@ -105,10 +123,24 @@ public:
 	//! Returns the list of element inside the given node (must be a leaf node).
 	const unsigned int* GetNodeElements(unsigned int nodeID) const { return &elements[nodes[nodeID].ElementOffset()]; }
 
+	//! Returns the position of the first element of the node in the list of all elements (must be a leaf node).
+	//! The elements of each leaf node are contiguous in this list.
+	unsigned int GetNodeElementOffset(unsigned int nodeID) const { return nodes[nodeID].ElementOffset(); }
+
+	//! Returns the list of all elements, in the order of the leaf nodes.
+	const unsigned int* GetElements() const { return elements; }
+
 	//////////////////////////////////////////////////////////////////////////!//!//!
 	//@ Clear and Build Methods
 	//////////////////////////////////////////////////////////////////////////!//!//!
 
+	//! Split methods that can be selected by the FindSplit implementations of sub-classes.
+	enum SplitMethod {
+		SPLIT_MEAN,			//!< Middle of the widest axis (used by the default FindSplit)
+		SPLIT_SAH_BINNED,	//!< Surface area heuristic evaluated at the borders of CY_BVH_SAH_BIN_COUNT bins per axis
+		SPLIT_SAH_SWEEP,	//!< Surface area heuristic evaluated between every pair of elements sorted along each axis
+	};
+
 	//! Clears the tree structure
 	void Clear()
 	{
@@ -134,13 +166,24 @@ public:
 			box += b;
 		}
 		TempNode *tempRoot = new TempNode( numElements, 0, box );
-		SplitTempNode(tempRoot,maxElementsPerNode);
+		SplitTempNode(tempRoot,maxElementsPerNode,ParallelBuildDepth());
 		unsigned int numNodes = tempRoot->GetNumNodes();
 		nodes = new Node[ numNodes+1 ];
 		ConvertTempData( 1, tempRoot, 2 );
 		delete tempRoot;
 	}
 
+	//! Returns the surface area heuristic cost of the tree, which is the expected cost of tracing a ray
+	//! that hits the root node, using the given costs of traversing a node and intersecting an element.
+	//! Lower is better, so it can be used to compare trees built with different split methods.
+	float GetSAHCost( float traversalCost=1.0f, float intersectionCost=1.0f ) const
+	{
+		if ( !nodes ) return 0;
+		float rootArea = BoxArea( GetNodeBounds(GetRootNodeID()) );
+		if ( rootArea <= 0 ) return 0;
+		return NodeSAHCost( GetRootNodeID(), traversalCost, intersectionCost ) / rootArea;
+	}
+
 	//////////////////////////////////////////////////////////////////////////!//!//!
 
 protected:
@@ -160,13 +203,25 @@ protected:
 	//! such that first N elements are to be assigned to the first child and the 
 	//! remaining elements are to be assigned to the second child node, then returns N.
 	//! Returns zero, if the node is not to be split.
+	//! parallelDepth is the number of tree levels below this node that are still built on
+	//! separate threads, the node can use multiple threads for the split only if it is not zero.
 	//! The default implementation splits the temporary node down the middle of the
 	//! widest axis of its bounding box.
-	virtual unsigned int FindSplit(unsigned int elementCount, unsigned int *elements, const float *box, unsigned int maxElementsPerNode )
+	virtual unsigned int FindSplit(unsigned int elementCount, unsigned int *elements, const float *box, unsigned int maxElementsPerNode, unsigned int parallelDepth )
 	{
 		return MeanSplit(elementCount,elements,box,maxElementsPerNode);
 	}
 
+	//! Splits the elements using the given split method, can be called by FindSplit.
+	unsigned int Split( SplitMethod method, unsigned int elementCount, unsigned int *elements, const float *box, unsigned int maxElementsPerNode, unsigned int parallelDepth )
+	{
+		switch ( method ) {
+		case SPLIT_SAH_BINNED:	return SAHBinnedSplit(elementCount,elements,box,maxElementsPerNode,parallelDepth);
+		case SPLIT_SAH_SWEEP:	return SAHSweepSplit(elementCount,elements,box,maxElementsPerNode);
+		default:				return MeanSplit(elementCount,elements,box,maxElementsPerNode);
+		}
+	}
+
 	//////////////////////////////////////////////////////////////////////////!//!//!
 
 private:
@@ -239,11 +294,15 @@ private:
 	};
 
 	//! Recursively splits the given temporary node.
-	void SplitTempNode(TempNode *tNode, unsigned int maxElementsPerNode)
+	//! The two children of a large node are split on separate threads until parallelDepth reaches zero.
+	//! Each child only touches its own range of the elements array, and the splits do not depend on
+	//! the thread that computes them, so the result is the same as a serial build.
+	void SplitTempNode(TempNode *tNode, unsigned int maxElementsPerNode, unsigned int parallelDepth)
 	{
+		bool parallel = parallelDepth > 0 && tNode->ElementCount() >= CY_BVH_PARALLEL_BUILD_MIN_ELEMENTS;
 		const float *box = tNode->GetBounds().b;
 		unsigned int *nodeElements = &elements[tNode->ElementOffset()];
-		unsigned int child1ElemCount = FindSplit(tNode->ElementCount(),nodeElements,box,maxElementsPerNode);
+		unsigned int child1ElemCount = FindSplit(tNode->ElementCount(),nodeElements,box,maxElementsPerNode,parallelDepth);
 
 		// If the FindSplit call does not return a valid split position
 		if ( child1ElemCount == 0 || child1ElemCount >= tNode->ElementCount() ) {
@@ -260,21 +319,86 @@ private:
 		// Compute child bounding boxes
 		Box child1Box;
 		Box child2Box;
-		for ( unsigned int i=0; i<child1ElemCount; i++ ) {
-			Box eBox;
-			GetElementBounds( nodeElements[i], eBox.b );
-			child1Box += eBox;
-		}
-		for ( unsigned int i=child1ElemCount; i<tNode->ElementCount(); i++ ) {
-			Box eBox;
-			GetElementBounds( nodeElements[i], eBox.b );
-			child2Box += eBox;
+		auto computeChild1Box = [&]() {
+			for ( unsigned int i=0; i<child1ElemCount; i++ ) {
+				Box eBox;
+				GetElementBounds( nodeElements[i], eBox.b );
+				child1Box += eBox;
+			}
+		};
+		auto computeChild2Box = [&]() {
+			for ( unsigned int i=child1ElemCount; i<tNode->ElementCount(); i++ ) {
+				Box eBox;
+				GetElementBounds( nodeElements[i], eBox.b );
+				child2Box += eBox;
+			}
+		};
+		if ( parallel ) {
+			std::future<void> child1Task = std::async( std::launch::async, computeChild1Box );
+			computeChild2Box();
+			child1Task.get();
+		} else {
+			computeChild1Box();
+			computeChild2Box();
 		}
 
 		// Split recursively
 		tNode->Split( child1ElemCount, child1Box, child2Box );
-		SplitTempNode(tNode->GetChild1(),maxElementsPerNode);
-		SplitTempNode(tNode->GetChild2(),maxElementsPerNode);
+		if ( parallel ) {
+			TempNode *child1 = tNode->GetChild1();
+			std::future<void> child1Task = std::async( std::launch::async, [this,child1,maxElementsPerNode,parallelDepth]() { SplitTempNode(child1,maxElementsPerNode,parallelDepth-1); } );
+			SplitTempNode(tNode->GetChild2(),maxElementsPerNode,parallelDepth-1);
+			child1Task.get();
+		} else {
+			SplitTempNode(tNode->GetChild1(),maxElementsPerNode,parallelDepth);
+			SplitTempNode(tNode->GetChild2(),maxElementsPerNode,parallelDepth);
+		}
+	}
+
+	//! Returns the number of hardware threads, at least 1.
+	//! The value is queried once, since the query is a system call on some platforms.
+	static unsigned int HardwareThreads()
+	{
+		static const unsigned int n = std::thread::hardware_concurrency();
+		return n > 0 ? n : 1;
+	}
+
+	//! Returns the number of tree levels that fork their subtrees to separate threads,
+	//! so that there are about twice as many subtree tasks as hardware threads.
+	static unsigned int ParallelBuildDepth()
+	{
+		unsigned int depth = 0;
+		if ( HardwareThreads() > 1 ) {
+			while ( (1u<<depth) < 2*HardwareThreads() ) depth++;
+		}
+		return depth;
+	}
+
+	//! Returns the number of chunks to process the elements of a node with, 1 for small nodes.
+	//! The nodes at the same tree level run concurrently while their subtrees are forked, so they share
+	//! the hardware threads, and the nodes below the fork depth use a single chunk.
+	static unsigned int ParallelChunkCount( unsigned int elementCount, unsigned int parallelDepth )
+	{
+		unsigned int buildDepth = ParallelBuildDepth();
+		if ( parallelDepth == 0 || parallelDepth > buildDepth ) return 1;
+		unsigned int n = elementCount / CY_BVH_PARALLEL_BUILD_MIN_ELEMENTS;
+		unsigned int threads = HardwareThreads() >> ( buildDepth - parallelDepth );
+		if ( n > threads ) n = threads;
+		return n > 0 ? n : 1;
+	}
+
+	//! Calls f(chunk,begin,end) for each of the chunkCount chunks of [0,count), the last chunk on the calling thread.
+	template <typename F>
+	static void ParallelFor( unsigned int count, unsigned int chunkCount, F f )
+	{
+		std::vector< std::future<void> > tasks;
+		for ( unsigned int c=0; c<chunkCount; c++ ) {
+			unsigned int begin = (unsigned int)( (unsigned long long)count * c / chunkCount );
+			unsigned int end   = (unsigned int)( (unsigned long long)count * (c+1) / chunkCount );
+			if ( c+1 < chunkCount ) tasks.push_back( std::async( std::launch::async, f, c, begin, end ) );
+			else f( c, begin, end );
+		}
+		for ( size_t t=0; t<tasks.size(); t++ ) tasks[t].get();
 	}
 
 	//! Recursively converts the temporary node data to NodeData.
@@ -327,11 +451,424 @@ private:
 		return child1ElemCount;
 	}
 
+	//! Returns the surface area of the given bounding box.
+	static float BoxArea( const float *b )
+	{
+		float dx = b[3]-b[0], dy = b[4]-b[1], dz = b[5]-b[2];
+		return 2.0f * ( dx*dy + dy*dz + dz*dx );
+	}
+
+	//! Returns the bin of an element center for the binned SAH split.
+	static int SAHBin( float center, float centerMin, float binScale )
+	{
+		int bin = (int)( (center-centerMin) * binScale );
+		return bin < CY_BVH_SAH_BIN_COUNT ? bin : CY_BVH_SAH_BIN_COUNT-1;
+	}
+
+	//! Splits the elements at the bin border with the minimum surface area heuristic cost.
+	//! The elements are placed into CY_BVH_SAH_BIN_COUNT equal sized bins of their centers along each axis.
+	unsigned int SAHBinnedSplit(unsigned int elementCount, unsigned int *nodeElements, const float *box, unsigned int maxElementsPerNode, unsigned int parallelDepth )
+	{
+		if ( elementCount <= maxElementsPerNode ) return 0;
+
+		// Bounding boxes and centers of the elements, large nodes above the fork depth are processed in parallel chunks
+		unsigned int chunkCount = ParallelChunkCount(elementCount,parallelDepth);
+		std::vector<Box> elemBoxes(elementCount);
+		std::vector<float> centers(elementCount*3);
+		std::vector<Box> chunkCenterBounds(chunkCount);
+		ParallelFor( elementCount, chunkCount, [&]( unsigned int chunk, unsigned int begin, unsigned int end ) {
+			Box cb;
+			for ( unsigned int i=begin; i<end; i++ ) {
+				GetElementBounds( nodeElements[i], elemBoxes[i].b );
+				for ( int d=0; d<3; d++ ) {
+					float c = GetElementCenter( nodeElements[i], d );
+					centers[i*3+d] = c;
+					if ( cb.b[d] > c ) cb.b[d] = c;
+					if ( cb.b[d+3] < c ) cb.b[d+3] = c;
+				}
+			}
+			chunkCenterBounds[chunk] = cb;
+		} );
+		Box centerBounds;
+		for ( unsigned int c=0; c<chunkCount; c++ ) centerBounds += chunkCenterBounds[c];
+		const float *cmin = centerBounds.b;
+		const float *cmax = centerBounds.b + 3;
+
+		float bestCost = 1e30f;
+		int bestDim = -1;
+		int bestBin = 0;
+		std::vector<Box> chunkBins(chunkCount*CY_BVH_SAH_BIN_COUNT);
+		std::vector<unsigned int> chunkCounts(chunkCount*CY_BVH_SAH_BIN_COUNT);
+		for ( int d=0; d<3; d++ ) {
+			float extent = cmax[d] - cmin[d];
+			if ( extent <= 0 ) continue;
+			float binScale = CY_BVH_SAH_BIN_COUNT / extent;
+
+			// Each chunk fills its own bins, then the bins are merged
+			const float *axisCenters = &centers[d];
+			const Box *boxes = &elemBoxes[0];
+			float centerMin = cmin[d];
+			ParallelFor( elementCount, chunkCount, [&]( unsigned int chunk, unsigned int begin, unsigned int end ) {
+				Box cbins[CY_BVH_SAH_BIN_COUNT];
+				unsigned int ccounts[CY_BVH_SAH_BIN_COUNT] = { 0 };
+				for ( unsigned int i=begin; i<end; i++ ) {
+					int b = SAHBin( axisCenters[i*3], centerMin, binScale );
+					cbins[b] += boxes[i];
+					ccounts[b]++;
+				}
+				for ( int b=0; b<CY_BVH_SAH_BIN_COUNT; b++ ) {
+					chunkBins[chunk*CY_BVH_SAH_BIN_COUNT+b] = cbins[b];
+					chunkCounts[chunk*CY_BVH_SAH_BIN_COUNT+b] = ccounts[b];
+				}
+			} );
+			Box bins[CY_BVH_SAH_BIN_COUNT];
+			unsigned int counts[CY_BVH_SAH_BIN_COUNT] = { 0 };
+			for ( unsigned int c=0; c<chunkCount; c++ ) {
+				for ( int b=0; b<CY_BVH_SAH_BIN_COUNT; b++ ) {
+					bins[b] += chunkBins[c*CY_BVH_SAH_BIN_COUNT+b];
+					counts[b] += chunkCounts[c*CY_BVH_SAH_BIN_COUNT+b];
+				}
+			}
+
+			// Sweep from the right to find the area and count on the right side of each border
+			float rightArea[CY_BVH_SAH_BIN_COUNT];
+			unsigned int rightCount[CY_BVH_SAH_BIN_COUNT];
+			Box rightBox;
+			unsigned int rc = 0;
+			for ( int b=CY_BVH_SAH_BIN_COUNT-1; b>0; b-- ) {
+				rightBox += bins[b];
+				rc += counts[b];
+				rightArea[b] = rc > 0 ? BoxArea(rightBox.b) : 0;
+				rightCount[b] = rc;
+			}
+
+			// Sweep from the left and evaluate the cost at each border
+			Box leftBox;
+			unsigned int lc = 0;
+			for ( int b=0; b<CY_BVH_SAH_BIN_COUNT-1; b++ ) {
+				leftBox += bins[b];
+				lc += counts[b];
+				if ( lc == 0 || rightCount[b+1] == 0 ) continue;
+				float cost = BoxArea(leftBox.b) * lc + rightArea[b+1] * rightCount[b+1];
+				if ( cost < bestCost ) {
+					bestCost = cost;
+					bestDim = d;
+					bestBin = b;
+				}
+			}
+		}
+
+		if ( bestDim < 0 ) return MeanSplit(elementCount,nodeElements,box,maxElementsPerNode);
+
+		// Move the elements in the bins up to bestBin to the front
+		float binScale = CY_BVH_SAH_BIN_COUNT / ( cmax[bestDim] - cmin[bestDim] );
+		unsigned int i=0, j=elementCount;
+		while ( i<j ) {
+			float center = GetElementCenter( nodeElements[i], bestDim );
+			if ( SAHBin( center, cmin[bestDim], binScale ) <= bestBin ) {
+				i++;
+			} else {
+				j--;
+				unsigned int t = nodeElements[i];
+				nodeElements[i] = nodeElements[j];
+				nodeElements[j] = t;
+			}
+		}
+
+		return i;
+	}
+
+	//! Splits the elements at the position with the minimum surface area heuristic cost.
+	//! The elements are sorted by their centers along each axis and every position between two elements is evaluated.
+	unsigned int SAHSweepSplit(unsigned int elementCount, unsigned int *nodeElements, const float *box, unsigned int maxElementsPerNode )
+	{
+		if ( elementCount <= maxElementsPerNode ) return 0;
+
+		std::vector< std::pair<float,unsigned int> > sorted(elementCount);
+		std::vector<Box> elemBoxes(elementCount);
+		std::vector<float> rightArea(elementCount);
+
+		float bestCost = 1e30f;
+		int bestDim = -1;
+		unsigned int bestCount = 0;
+		for ( int d=0; d<3; d++ ) {
+			for ( unsigned int i=0; i<elementCount; i++ ) {
+				sorted[i] = std::make_pair( GetElementCenter( nodeElements[i], d ), nodeElements[i] );
+			}
+			std::sort( sorted.begin(), sorted.end() );
+			for ( unsigned int i=0; i<elementCount; i++ ) {
+				elemBoxes[i].Init();
+				GetElementBounds( sorted[i].second, elemBoxes[i].b );
+			}
+
+			Box rightBox;
+			for ( unsigned int i=elementCount-1; i>0; i-- ) {
+				rightBox += elemBoxes[i];
+				rightArea[i] = BoxArea(rightBox.b);
+			}
+
+			Box leftBox;
+			for ( unsigned int i=0; i<elementCount-1; i++ ) {
+				leftBox += elemBoxes[i];
+				float cost = BoxArea(leftBox.b) * (i+1) + rightArea[i+1] * (elementCount-i-1);
+				if ( cost < bestCost ) {
+					bestCost = cost;
+					bestDim = d;
+					bestCount = i+1;
+				}
+			}
+		}
+
+		if ( bestDim < 0 ) return MeanSplit(elementCount,nodeElements,box,maxElementsPerNode);
+
+		// Sort the elements along the best axis
+		for ( unsigned int i=0; i<elementCount; i++ ) {
+			sorted[i] = std::make_pair( GetElementCenter( nodeElements[i], bestDim ), nodeElements[i] );
+		}
+		std::sort( sorted.begin(), sorted.end() );
+		for ( unsigned int i=0; i<elementCount; i++ ) nodeElements[i] = sorted[i].second;
+
+		return bestCount;
+	}
+
+	//! Recursively sums up the surface area heuristic cost of the given node and its children.
+	float NodeSAHCost( unsigned int nodeID, float traversalCost, float intersectionCost ) const
+	{
+		float area = BoxArea( GetNodeBounds(nodeID) );
+		if ( IsLeafNode(nodeID) ) return area * intersectionCost * GetNodeElementCount(nodeID);
+		return area * traversalCost
+			+ NodeSAHCost( GetFirstChildNode(nodeID), traversalCost, intersectionCost )
+			+ NodeSAHCost( GetSecondChildNode(nodeID), traversalCost, intersectionCost );
+	}
+
 	//////////////////////////////////////////////////////////////////////////!//!//!
 };
 
 //-------------------------------------------------------------------------------
 
+//! Four-wide Bounding Volume Hierarchy, collapsed from a binary BVH.
+//!
+//! Each node keeps the bounding boxes of its four children as a structure of arrays,
+//! so that a ray is tested against all four boxes at once with SSE instructions
+//! (or with a scalar loop, when SSE is not available). Unused child slots have
+//! empty boxes, which no ray can hit.
+
+class BVH4
+{
+public:
+	//! Node of the four-wide BVH.
+	struct Node
+	{
+		float bounds[6][4];				//!< Minimum x, y, z and maximum x, y, z coordinates of the four child boxes
+		unsigned int child[4];			//!< Node index of an internal child, or the offset of the first element of a leaf child
+		unsigned int elementCount[4];	//!< Number of elements of a leaf child, zero for an internal child
+		bool IsLeafChild(int i) const { return elementCount[i] > 0; }
+	};
+
+	//!@name Constructors
+	BVH4() {}
+	BVH4(const BVH &bvh, unsigned int leafAlignment=1) { Build(bvh,leafAlignment); }
+
+	//! Clears the tree structure.
+	void Clear() { nodes.clear(); elements.clear(); }
+
+	//! Builds the four-wide hierarchy from the given binary BVH.
+	//! Each node takes the descendants of a binary node that are at most two levels below it,
+	//! opening the child with the largest surface area first.
+	//! The elements of each leaf start at a multiple of leafAlignment and the gap after a leaf is
+	//! filled with EMPTY_ELEMENT, so that the leaves can be processed in fixed size blocks.
+	void Build(const BVH &bvh, unsigned int leafAlignment=1)
+	{
+		Clear();
+		alignment = leafAlignment > 0 ? leafAlignment : 1;
+		nodes.push_back( EmptyNode() );
+		unsigned int root = bvh.GetRootNodeID();
+		if ( bvh.IsLeafNode(root) ) SetChild( bvh, 0, 0, root );
+		else CollapseNode( bvh, 0, root );
+	}
+
+	//! Returns the index of the root node.
+	unsigned int GetRootNodeID() const { return 0; }
+
+	//! Returns the node with the given index.
+	const Node& GetNode(unsigned int nodeID) const { return nodes[nodeID]; }
+
+	//! Returns the number of nodes.
+	unsigned int GetNumNodes() const { return (unsigned int)nodes.size(); }
+
+	//! Returns the number of elements, including the EMPTY_ELEMENT padding of the leaves.
+	//! The leaves are stored in depth first order.
+	unsigned int GetNumElements() const { return (unsigned int)elements.size(); }
+
+	//! Returns the elements of a leaf child, given the child value of its parent node.
+	const unsigned int* GetElements(unsigned int elementOffset) const { return &elements[elementOffset]; }
+
+	//! Intersects a ray with the four child boxes of the given node.
+	//! The ray is given by its origin, the reciprocal of its direction and the sign of the direction
+	//! (1 for negative components), which selects the near plane of each slab.
+	//! Returns a bit mask of the children hit within [0,tMax] and writes their entry distances to tEntry.
+	static int IntersectChildren( const Node &node, const float origin[3], const float invDir[3], const int sign[3], float tMax, float tEntry[4] )
+	{
+		// The exit distance is enlarged slightly, so that rounding does not miss boxes with zero thickness or grazing rays
+		const float exitScale = 1.0000004f;
+#ifdef _CY_BVH_SSE
+		__m128 entry = _mm_setzero_ps();
+		__m128 exit  = _mm_set1_ps( tMax );
+		for ( int d=0; d<3; d++ ) {
+			int nearSide = sign[d]*3;
+			__m128 o   = _mm_set1_ps( origin[d] );
+			__m128 inv = _mm_set1_ps( invDir[d] );
+			__m128 tNear = _mm_mul_ps( _mm_sub_ps( _mm_loadu_ps( node.bounds[d+nearSide] ), o ), inv );
+			__m128 tFar  = _mm_mul_ps( _mm_sub_ps( _mm_loadu_ps( node.bounds[d+3-nearSide] ), o ), inv );
+			// The new value is the first operand, so a NaN (origin on a plane of a flat axis) is ignored
+			entry = _mm_max_ps( tNear, entry );
+			exit  = _mm_min_ps( _mm_mul_ps( tFar, _mm_set1_ps(exitScale) ), exit );
+		}
+		_mm_storeu_ps( tEntry, entry );
+		return _mm_movemask_ps( _mm_cmple_ps( entry, exit ) );
+#else
+		int mask = 0;
+		for ( int i=0; i<4; i++ ) {
+			float entry = 0;
+			float exit  = tMax;
+			for ( int d=0; d<3; d++ ) {
+				int nearSide = sign[d]*3;
+				float tNear = ( node.bounds[d+nearSide][i] - origin[d] ) * invDir[d];
+				float tFar  = ( node.bounds[d+3-nearSide][i] - origin[d] ) * invDir[d] * exitScale;
+				entry = tNear > entry ? tNear : entry;
+				exit  = tFar  < exit  ? tFar  : exit;
+			}
+			tEntry[i] = entry;
+			if ( entry <= exit ) mask |= 1<<i;
+		}
+		return mask;
+#endif
+	}
+
+	//! Conservative test of a packet of rays against the four child boxes of the given node.
+	//! The rays share the direction signs, their origins are bounded by [originMin,originMax] and the
+	//! reciprocals of their directions by [invDirMin,invDirMax]. Returns a bit mask of the children that
+	//! any of the rays may hit within [0,tMax], and writes lower bounds of their entry distances to tEntry.
+	static int IntersectChildrenInterval( const Node &node, const float originMin[3], const float originMax[3],
+		const float invDirMin[3], const float invDirMax[3], const int sign[3], float tMax, float tEntry[4] )
+	{
+		const float exitScale = 1.0000004f;
+#ifdef _CY_BVH_SSE
+		__m128 entry = _mm_setzero_ps();
+		__m128 exit  = _mm_set1_ps( tMax );
+		for ( int d=0; d<3; d++ ) {
+			int nearSide = sign[d]*3;
+			// The nearest plane distance comes from the origin farthest along the direction, and vice versa
+			__m128 nearO  = _mm_set1_ps( sign[d] ? originMin[d] : originMax[d] );
+			__m128 farO   = _mm_set1_ps( sign[d] ? originMax[d] : originMin[d] );
+			__m128 invMin = _mm_set1_ps( invDirMin[d] );
+			__m128 invMax = _mm_set1_ps( invDirMax[d] );
+			__m128 a = _mm_sub_ps( _mm_loadu_ps( node.bounds[d+nearSide] ), nearO );
+			__m128 b = _mm_sub_ps( _mm_loadu_ps( node.bounds[d+3-nearSide] ), farO );
+			__m128 tNear = _mm_min_ps( _mm_mul_ps( a, invMin ), _mm_mul_ps( a, invMax ) );
+			__m128 tFar  = _mm_max_ps( _mm_mul_ps( b, invMin ), _mm_mul_ps( b, invMax ) );
+			entry = _mm_max_ps( tNear, entry );
+			exit  = _mm_min_ps( _mm_mul_ps( tFar, _mm_set1_ps(exitScale) ), exit );
+		}
+		_mm_storeu_ps( tEntry, entry );
+		return _mm_movemask_ps( _mm_cmple_ps( entry, exit ) );
+#else
+		int mask = 0;
+		for ( int i=0; i<4; i++ ) {
+			float entry = 0;
+			float exit  = tMax;
+			for ( int d=0; d<3; d++ ) {
+				int nearSide = sign[d]*3;
+				float a = node.bounds[d+nearSide][i] - ( sign[d] ? originMin[d] : originMax[d] );
+				float b = node.bounds[d+3-nearSide][i] - ( sign[d] ? originMax[d] : originMin[d] );
+				float a0 = a*invDirMin[d], a1 = a*invDirMax[d];
+				float b0 = b*invDirMin[d], b1 = b*invDirMax[d];
+				float tNear = a0 < a1 ? a0 : a1;
+				float tFar  = ( b0 > b1 ? b0 : b1 ) * exitScale;
+				entry = tNear > entry ? tNear : entry;
+				exit  = tFar  < exit  ? tFar  : exit;
+			}
+			tEntry[i] = entry;
+			if ( entry <= exit ) mask |= 1<<i;
+		}
+		return mask;
+#endif
+	}
+
+	//! Element index that fills the gaps between aligned leaves.
+	static const unsigned int EMPTY_ELEMENT = 0xFFFFFFFF;
+
+private:
+	std::vector<Node> nodes;
+	std::vector<unsigned int> elements;
+	unsigned int alignment = 1;
+
+	//! Returns a node with four empty child boxes.
+	static Node EmptyNode()
+	{
+		Node n;
+		for ( int i=0; i<4; i++ ) {
+			for ( int d=0; d<3; d++ ) { n.bounds[d][i] = 1e30f; n.bounds[d+3][i] = -1e30f; }
+			n.child[i] = 0;
+			n.elementCount[i] = 0;
+		}
+		return n;
+	}
+
+	//! Returns the surface area of the given bounding box.
+	static float BoxArea( const float *b )
+	{
+		float dx = b[3]-b[0], dy = b[4]-b[1], dz = b[5]-b[2];
+		return 2.0f * ( dx*dy + dy*dz + dz*dx );
+	}
+
+	//! Fills the given node with up to four descendants of the internal binary node.
+	void CollapseNode( const BVH &bvh, unsigned int nodeID, unsigned int binaryNodeID )
+	{
+		unsigned int children[4];
+		unsigned int childCount = 2;
+		bvh.GetChildNodes( binaryNodeID, children[0], children[1] );
+		while ( childCount < 4 ) {
+			int open = -1;
+			float openArea = -1;
+			for ( unsigned int i=0; i<childCount; i++ ) {
+				if ( bvh.IsLeafNode(children[i]) ) continue;
+				float area = BoxArea( bvh.GetNodeBounds(children[i]) );
+				if ( area > openArea ) { openArea = area; open = i; }
+			}
+			if ( open < 0 ) break;
+			unsigned int c = children[open];
+			bvh.GetChildNodes( c, children[open], children[childCount] );
+			childCount++;
+		}
+		for ( unsigned int i=0; i<childCount; i++ ) SetChild( bvh, nodeID, i, children[i] );
+	}
+
+	//! Sets the i^th child of the given node to the binary node, building its subtree if it is an internal node.
+	void SetChild( const BVH &bvh, unsigned int nodeID, int i, unsigned int binaryNodeID )
+	{
+		const float *b = bvh.GetNodeBounds( binaryNodeID );
+		for ( int d=0; d<6; d++ ) nodes[nodeID].bounds[d][i] = b[d];
+		if ( bvh.IsLeafNode(binaryNodeID) ) {
+			unsigned int count = bvh.GetNodeElementCount( binaryNodeID );
+			const unsigned int *e = bvh.GetNodeElements( binaryNodeID );
+			nodes[nodeID].child[i] = (unsigned int)elements.size();
+			nodes[nodeID].elementCount[i] = count;
+			elements.insert( elements.end(), e, e+count );
+			while ( elements.size() % alignment ) elements.push_back( (unsigned int)EMPTY_ELEMENT );
+		} else {
+			// The node array may grow, so the node is accessed by index
+			unsigned int childID = (unsigned int)nodes.size();
+			nodes.push_back( EmptyNode() );
+			nodes[nodeID].child[i] = childID;
+			nodes[nodeID].elementCount[i] = 0;
+			CollapseNode( bvh, childID, binaryNodeID );
+		}
+	}
+};
+
+//-------------------------------------------------------------------------------
+
 #ifdef _CY_TRIMESH_H_INCLUDED_
 
 //! Bounding Volume Hierarchy for triangular meshes (TriMesh)
@@ -340,18 +877,27 @@ class BVHTriMesh : public BVH
 {
 public:
 	//!@name Constructors
-	BVHTriMesh() : mesh(0) {}
-	BVHTriMesh(const TriMesh *m) { SetMesh(m); }
+	BVHTriMesh() : mesh(0), splitMethod(SPLIT_MEAN) {}
+	BVHTriMesh(const TriMesh *m) : splitMethod(SPLIT_MEAN) { SetMesh(m); }
 
-	//! Sets the mesh pointer and builds the BVH structure.
-	void SetMesh(const TriMesh *m, unsigned int maxElementsPerNode=CY_BVH_MAX_ELEMENT_COUNT)
+	//! Sets the mesh pointer and builds the BVH structure with the given split method.
+	void SetMesh(const TriMesh *m, unsigned int maxElementsPerNode=CY_BVH_MAX_ELEMENT_COUNT, SplitMethod method=SPLIT_MEAN)
 	{
 		mesh = m;
+		splitMethod = method;
 		Clear();
 		Build(mesh->NF(),maxElementsPerNode);
 	}
 
+	SplitMethod GetSplitMethod() const { return splitMethod; }
+
 protected:
+	//! Splits the elements using the split method of the mesh.
+	virtual unsigned int FindSplit(unsigned int elementCount, unsigned int *elements, const float *box, unsigned int maxElementsPerNode, unsigned int parallelDepth )
+	{
+		return Split(splitMethod,elementCount,elements,box,maxElementsPerNode,parallelDepth);
+	}
+
 	//! Sets box as the i^th element's bounding box.
 	virtual void GetElementBounds(unsigned int i, float box[6]) const
 	{
@@ -376,6 +922,7 @@ protected:
 
 private:
 	const TriMesh *mesh;
+	SplitMethod splitMethod;
 };
 
 #endif
@@ -385,6 +932,7 @@ private:
 //-------------------------------------------------------------------------------
 
 typedef cy::BVH cyBVH;	//!< Bounding Volume Hierarchy class
+typedef cy::BVH4 cyBVH4;	//!< Four-wide Bounding Volume Hierarchy class
 
 #ifdef _CY_TRIMESH_H_INCLUDED_
 typedef cy::BVHTriMesh cyBVHTriMesh;	//!< BVH hierarchy for triangular meshes (TriMesh)
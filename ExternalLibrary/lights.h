@@ -51,6 +51,9 @@ public:
 
 	void SetIntensity(Color intens) { intensity=intens; }
 	void SetDirection(Point3 dir) { direction=dir.GetNormalized(); }
+
+	// Wavefront Extensions
+	virtual Color SampleIllumination(const Point3 &p, Ray &shadowRay, float &shadowT) const { shadowRay=Ray(p,-direction); shadowT=BIGFLOAT; return intensity; }
 private:
 	Color intensity;
 	Point3 direction;
@@ -90,6 +93,9 @@ public:
 	virtual bool	IsPhotonSource()		const { return true; }
 	virtual Color	GetPhotonIntensity()	const { return intensity; }
 	virtual Ray		RandomPhoton()			const;
+
+	// Wavefront Extensions
+	virtual Color	SampleIllumination(const Point3 &p, Ray &shadowRay, float &shadowT) const;
 
 private:
 	Color intensity;
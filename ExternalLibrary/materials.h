@@ -22,7 +22,8 @@ public:
 	MtlBlinn() : diffuse(0.5f,0.5f,0.5f), specular(0.7f,0.7f,0.7f), glossiness(20.0f), emission(0,0,0),
 				 reflection(0,0,0), refraction(0,0,0), absorption(0,0,0), ior(1),
 				 reflectionGlossiness(0), refractionGlossiness(0) {}
-	virtual Color Shade(const Ray &ray, const HitInfo &hInfo, const LightList &lights, int bounceCount) const;
+	using Material::Shade;
+	virtual Color Shade(const Ray &ray, const HitInfo &hInfo, const LightList &lights, int bounceCount, const Color &indirect) const;
 
 	void SetDiffuse		(Color dif)		{ diffuse.SetColor(dif); }
 	void SetSpecular	(Color spec)	{ specular.SetColor(spec); }
@@ -47,6 +48,11 @@ public:
 	// Photon Extensions
 	virtual bool IsPhotonSurface(int subMtlID=0) const { return diffuse.GetColor().Gray() > 0; }	// if this method returns true, the photon will be stored
 	virtual bool RandomPhotonBounce(Ray &r, Color &c, HitInfo &hInfo) const;	// if this method returns true, a new photon with the given direction and color will be traced
+
+	// Wavefront Extensions
+	virtual Color ShadeLight(const HitInfo &hInfo, const Light *light, const Color &illumination) const;
+	virtual Color GetIndirectWeight(const HitInfo &hInfo) const { return hInfo.front ? diffuse.Sample(hInfo.uvw) : Color(0,0,0); }
+	virtual int   GetSecondaryRays(const Ray &ray, const HitInfo &hInfo, SecondaryRay *rays) const;
 
 private:
 	TexturedColor diffuse, specular, reflection, refraction, emission;
@@ -63,7 +69,8 @@ class MultiMtl : public Material
 public:
 	virtual ~MultiMtl() { for ( unsigned int i=0; i<mtls.size(); i++ ) delete mtls[i]; }
 
-	virtual Color Shade(const Ray &ray, const HitInfo &hInfo, const LightList &lights, int bounceCount) const { return hInfo.mtlID<(int)mtls.size() ? mtls[hInfo.mtlID]->Shade(ray,hInfo,lights,bounceCount) : Color(1,1,1); }
+	using Material::Shade;
+	virtual Color Shade(const Ray &ray, const HitInfo &hInfo, const LightList &lights, int bounceCount, const Color &indirect) const { return hInfo.mtlID<(int)mtls.size() ? mtls[hInfo.mtlID]->Shade(ray,hInfo,lights,bounceCount,indirect) : Color(1,1,1); }
 
 	virtual void SetViewportMaterial(int subMtlID=0) const { if ( subMtlID<(int)mtls.size() ) mtls[subMtlID]->SetViewportMaterial(); }
 
@@ -72,6 +79,11 @@ public:
 	// Photon Extensions
 	virtual bool IsPhotonSurface(int subMtlID=0) const { return mtls[subMtlID]->IsPhotonSurface(); }
 	virtual bool RandomPhotonBounce(Ray &r, Color &c, HitInfo &hInfo) const { return hInfo.mtlID<(int)mtls.size() ? mtls[hInfo.mtlID]->RandomPhotonBounce(r,c,hInfo) : false; }
+
+	// Wavefront Extensions
+	virtual Color ShadeLight(const HitInfo &hInfo, const Light *light, const Color &illumination) const { return hInfo.mtlID<(int)mtls.size() ? mtls[hInfo.mtlID]->ShadeLight(hInfo,light,illumination) : Color(0,0,0); }
+	virtual Color GetIndirectWeight(const HitInfo &hInfo) const { return hInfo.mtlID<(int)mtls.size() ? mtls[hInfo.mtlID]->GetIndirectWeight(hInfo) : Color(0,0,0); }
+	virtual int   GetSecondaryRays(const Ray &ray, const HitInfo &hInfo, SecondaryRay *rays) const { return hInfo.mtlID<(int)mtls.size() ? mtls[hInfo.mtlID]->GetSecondaryRays(ray,hInfo,rays) : 0; }
 
 private:
 	std::vector<Material*> mtls;
@@ -21,7 +21,9 @@
 class Sphere : public Object
 {
 public:
-	virtual bool IntersectRay( const Ray &ray, HitInfo &hInfo, int hitSide=HIT_FRONT ) const;
+	virtual bool IntersectHit( const Ray &ray, HitRecord &hit, int hitSide=HIT_FRONT ) const;
+	virtual void SetHitInfo( const Ray &ray, const HitRecord &hit, HitInfo &hInfo ) const;
+	virtual bool IntersectShadow( const Ray &ray, float t_max ) const;
 	virtual Box GetBoundBox() const { return Box(-1,-1,-1,1,1,1); }
 	virtual void ViewportDisplay(const Material *mtl) const;
 };
@@ -33,7 +35,9 @@ extern Sphere theSphere;
 class Plane : public Object
 {
 public:
-	virtual bool IntersectRay( const Ray &ray, HitInfo &hInfo, int hitSide=HIT_FRONT ) const;
+	virtual bool IntersectHit( const Ray &ray, HitRecord &hit, int hitSide=HIT_FRONT ) const;
+	virtual void SetHitInfo( const Ray &ray, const HitRecord &hit, HitInfo &hInfo ) const;
+	virtual bool IntersectShadow( const Ray &ray, float t_max ) const;
 	virtual Box GetBoundBox() const { return Box(-1,-1,0,1,1,0); }
 	virtual void ViewportDisplay(const Material *mtl) const;
 };
@@ -45,23 +49,44 @@ extern Plane thePlane;
 class TriObj : public Object, public cyTriMesh
 {
 public:
-	virtual bool IntersectRay( const Ray &ray, HitInfo &hInfo, int hitSide=HIT_FRONT ) const;
+	virtual bool IntersectHit( const Ray &ray, HitRecord &hit, int hitSide=HIT_FRONT ) const;
+	virtual void SetHitInfo( const Ray &ray, const HitRecord &hit, HitInfo &hInfo ) const;
+	virtual int IntersectPacket( const RayPacket &packet, HitRecord *hit, int hitSide=HIT_FRONT ) const;
+	virtual bool IntersectShadow( const Ray &ray, float t_max ) const;
+	virtual int IntersectShadowPacket( const RayPacket &packet, const float *t_max, int activeMask ) const;
 	virtual Box GetBoundBox() const { return Box(GetBoundMin(),GetBoundMax()); }
 	virtual void ViewportDisplay(const Material *mtl) const;
 
-	bool Load(const char *filename, bool loadMtl)
+	bool Load(const char *filename, bool loadMtl, cyBVH::SplitMethod bvhSplit=cyBVH::SPLIT_MEAN)
 	{
 		bvh.Clear();
+		bvh4.Clear();
 		if ( ! LoadFromFileObj( filename, loadMtl ) ) return false;
 		if ( ! HasNormals() ) ComputeNormals();
 		ComputeBoundingBox();
-		bvh.SetMesh(this,4);
+		bvh.SetMesh(this,4,bvhSplit);
+		bvh4.Build(bvh,4);
+		BuildTriangles();
 		return true;
 	}
 
+	const cyBVHTriMesh& GetBVH() const { return bvh; }
+
 private:
+	// Precomputed data of four triangles for the ray intersection test, as a structure of arrays
+	// Unused slots have zero edges, which no ray can hit
+	struct alignas(16) TriangleBlock
+	{
+		float v0[3][4];				// x, y, z of the first vertices
+		float e1[3][4], e2[3][4];	// edges from the first vertex to the second and third vertices
+		unsigned int faceID[4];
+	};
+
 	cyBVHTriMesh bvh;
-	bool IntersectTriangle( const Ray &ray, HitInfo &hInfo, int hitSide, unsigned int faceID ) const;
+	cyBVH4 bvh4;	// four-wide copy of bvh that is used for ray traversal, its leaves are aligned to the blocks
+	std::vector<TriangleBlock> triangleBlocks;	// in the element order of bvh4, four elements per block
+	void BuildTriangles();
+	int IntersectTriangles( const Ray &ray, const TriangleBlock &block, float tMax, float &t, float &u, float &v ) const;
 	bool TraceBVHNode( const Ray &ray, HitInfo &hInfo, int hitSide, unsigned int nodeID ) const;
 };
 
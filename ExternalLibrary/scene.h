@@ -60,11 +60,61 @@ class Ray
 {
 public:
 	Point3 p, dir;
+	Point3 invDir;	// Reciprocal of dir, cached for the slab tests of bounding boxes
+	int sign[3];	// 1 for the axes where dir is negative, selects the near plane of each slab
 
 	Ray() {}
-	Ray(const Point3 &_p, const Point3 &_dir) : p(_p), dir(_dir) {}
-	Ray(const Ray &r) : p(r.p), dir(r.dir) {}
-	void Normalize() { dir.Normalize(); }
+	Ray(const Point3 &_p, const Point3 &_dir) : p(_p), dir(_dir) { UpdateInverse(); }
+	Ray(const Ray &r) : p(r.p), dir(r.dir), invDir(r.invDir) { sign[0]=r.sign[0]; sign[1]=r.sign[1]; sign[2]=r.sign[2]; }
+	void Normalize() { dir.Normalize(); UpdateInverse(); }
+
+	// Must be called after dir is assigned directly
+	void UpdateInverse()
+	{
+		invDir.Set( 1.0f/dir.x, 1.0f/dir.y, 1.0f/dir.z );
+		for ( int i=0; i<3; i++ ) sign[i] = invDir[i] < 0;
+	}
+};
+
+//-------------------------------------------------------------------------------
+
+// A small group of coherent rays that are traced together.
+// The packet is bounded by the intervals of the ray origins and reciprocal directions, so that a
+// single conservative slab test tells if any of the rays can hit a box.
+class RayPacket
+{
+public:
+	enum { MAX_SIZE = 8 };
+
+	Ray ray[MAX_SIZE];
+	int size;
+	Point3 originMin, originMax;	// Bounds of the ray origins
+	Point3 invDirMin, invDirMax;	// Bounds of the reciprocal directions
+	int sign[3];					// Direction signs, the same for all rays
+
+	RayPacket() : size(0) {}
+
+	// Sets the rays of the packet and computes its bounds.
+	// Returns false if the rays do not have the same direction signs. The intervals of such a packet
+	// would contain infinite reciprocals, so its rays must be traced one by one.
+	bool Set( const Ray *rays, int n )
+	{
+		size = n;
+		for ( int i=0; i<n; i++ ) ray[i] = rays[i];
+		originMin = originMax = ray[0].p;
+		invDirMin = invDirMax = ray[0].invDir;
+		for ( int d=0; d<3; d++ ) sign[d] = ray[0].sign[d];
+		for ( int i=1; i<n; i++ ) {
+			for ( int d=0; d<3; d++ ) {
+				if ( ray[i].sign[d] != sign[d] ) return false;
+				if ( originMin[d] > ray[i].p[d] ) originMin[d] = ray[i].p[d];
+				if ( originMax[d] < ray[i].p[d] ) originMax[d] = ray[i].p[d];
+				if ( invDirMin[d] > ray[i].invDir[d] ) invDirMin[d] = ray[i].invDir[d];
+				if ( invDirMax[d] < ray[i].invDir[d] ) invDirMax[d] = ray[i].invDir[d];
+			}
+		}
+		return true;
+	}
 };
 
 //-------------------------------------------------------------------------------
@@ -122,7 +172,14 @@ public:
 	bool IsInside(const Point3 &p) const { for ( int i=0; i<3; i++ ) if ( pmin[i] > p[i] || pmax[i] < p[i] ) return false; return true; }
 
 	// Returns true if the ray intersects with the box for any parameter that is smaller than t_max; otherwise, returns false.
-	bool IntersectRay(const Ray &r, float t_max) const;
+	bool IntersectRay(const Ray &r, float t_max) const { float tEntry; return IntersectRay(r,t_max,tEntry); }
+
+	// Same as above, and also returns the parameter where the ray enters the box.
+	bool IntersectRay(const Ray &r, float t_max, float &tEntry) const;
+
+	// Conservative test of a ray packet, returns false only if none of the rays can hit the box before t_max.
+	// tEntry is a lower bound of the parameters where the rays enter the box.
+	bool IntersectPacket(const RayPacket &packet, float t_max, float &tEntry) const;
 };
 
 //-------------------------------------------------------------------------------
@@ -162,6 +219,18 @@ struct HitInfo
 	void Init() { z=BIGFLOAT; node=NULL; front=true; uvw.Set(0.5f,0.5f,0.5f); duvw[0].Zero(); duvw[1].Zero(); mtlID=0; }
 };
 
+// The closest hit of an object before its hit information is computed, see Object::IntersectHit()
+// It is small enough to be kept for every ray in flight, the HitInfo is only filled in for shading
+struct HitRecord
+{
+	float z;				// the distance from the ray center to the hit point
+	float u, v;				// position of the hit on the primitive, such as barycentric coordinates
+	unsigned int primitive;	// the part of the object that is hit, such as a face index
+	unsigned int instance;	// the scene instance that is hit, set by the scene traversal
+
+	HitRecord() : z(BIGFLOAT), u(0), v(0), primitive(0), instance(0) {}
+};
+
 //-------------------------------------------------------------------------------
 
 class ItemBase
@@ -226,11 +295,13 @@ private:
 	Matrix3 tm;						// Transformation matrix to the local space
 	Point3 pos;						// Translation part of the transformation matrix
 	mutable Matrix3 itm;			// Inverse of the transformation matrix (cached)
+	Matrix3 ntm;					// Normal matrix, the inverse transpose of the transformation matrix (cached)
 public:
-	Transformation() : pos(0,0,0) { tm.SetIdentity(); itm.SetIdentity(); }
+	Transformation() : pos(0,0,0) { tm.SetIdentity(); itm.SetIdentity(); ntm.SetIdentity(); }
 	const Matrix3& GetTransform() const { return tm; }
 	const Point3& GetPosition() const { return pos; }
 	const Matrix3&	GetInverseTransform() const { return itm; }
+	const Matrix3&	GetNormalTransform() const { return ntm; }
 
 	Point3 TransformTo( const Point3 &p ) const { return itm * (p - pos); }	// Transform to the local coordinate system
 	Point3 TransformFrom( const Point3 &p ) const { return tm*p + pos; }	// Transform from the local coordinate system
@@ -239,16 +310,21 @@ public:
 	Point3 VectorTransformTo( const Point3 &dir ) const { return TransposeMult(tm,dir); }
 
 	// Transforms a vector from the local coordinate system (same as multiplication with the inverse transpose of the transformation)
-	Point3 VectorTransformFrom( const Point3 &dir ) const { return TransposeMult(itm,dir); }
+	Point3 VectorTransformFrom( const Point3 &dir ) const { return ntm * dir; }
 
 	void Translate(Point3 p) { pos+=p; }
 	void Rotate(Point3 axis, float degree) { Matrix3 m; m.SetRotation(axis,degree*(float)M_PI/180.0f); Transform(m); }
 	void Scale(float sx, float sy, float sz) { Matrix3 m; m.Zero(); m[0]=sx; m[4]=sy; m[8]=sz; Transform(m); }
-	void Transform(const Matrix3 &m) { tm=m*tm; pos=m*pos; tm.GetInverse(itm); }
+	void Transform(const Matrix3 &m) { tm=m*tm; pos=m*pos; UpdateInverse(); }
+
+	// Applies the parent transformation on top of this one, the result transforms from the local space to the space of the parent's parent
+	void Transform(const Transformation &parent) { tm=parent.tm*tm; pos=parent.tm*pos+parent.pos; UpdateInverse(); }
 
-	void InitTransform() { pos.Zero(); tm.SetIdentity(); itm.SetIdentity(); }
+	void InitTransform() { pos.Zero(); tm.SetIdentity(); itm.SetIdentity(); ntm.SetIdentity(); }
 
 private:
+	void UpdateInverse() { tm.GetInverse(itm); itm.GetTranspose(ntm); }
+
 	// Multiplies the given vector with the transpose of the given matrix
 	static Point3 TransposeMult( const Matrix3 &m, const Point3 &dir )
 	{
@@ -264,12 +340,66 @@ private:
 
 class Material;
 
+// A reflection or refraction ray of a material, see Material::GetSecondaryRays()
+struct SecondaryRay
+{
+	Ray   ray;
+	Color hitWeight;	// weight of the light shaded at the hit point of the ray
+	Color missWeight;	// weight of the environment if the ray leaves the scene
+	Color absorption;	// absorbed along the ray if it hits a back face
+};
+
 // Base class for all object types
 class Object
 {
 public:
-	virtual bool IntersectRay( const Ray &ray, HitInfo &hInfo, int hitSide=HIT_FRONT ) const=0;
 	virtual Box  GetBoundBox() const=0;
+
+	// Intersection is split into two steps. IntersectHit only finds a hit closer than hit.z and
+	// records where it is, SetHitInfo then computes the hit information of the closest hit once.
+	virtual bool IntersectHit( const Ray &ray, HitRecord &hit, int hitSide=HIT_FRONT ) const=0;
+	virtual void SetHitInfo( const Ray &ray, const HitRecord &hit, HitInfo &hInfo ) const=0;
+
+	bool IntersectRay( const Ray &ray, HitInfo &hInfo, int hitSide=HIT_FRONT ) const
+	{
+		HitRecord hit;
+		hit.z = hInfo.z;
+		if ( ! IntersectHit( ray, hit, hitSide ) ) return false;
+		SetHitInfo( ray, hit, hInfo );
+		return true;
+	}
+
+	// Intersects the rays of a packet, each ray with its own hit record in hit.
+	// Returns a bit mask of the rays that found a closer hit. The default traces the rays one by one.
+	virtual int IntersectPacket( const RayPacket &packet, HitRecord *hit, int hitSide=HIT_FRONT ) const
+	{
+		int hitMask = 0;
+		for ( int i=0; i<packet.size; i++ ) {
+			if ( IntersectHit( packet.ray[i], hit[i], hitSide ) ) hitMask |= 1<<i;
+		}
+		return hitMask;
+	}
+
+	// Returns true if the ray hits the object closer than t_max, used for shadow rays.
+	// Any hit will do, so the hit information is not computed. The default uses IntersectHit.
+	virtual bool IntersectShadow( const Ray &ray, float t_max ) const
+	{
+		HitRecord hit;
+		hit.z = t_max;
+		return IntersectHit( ray, hit, HIT_FRONT_AND_BACK );
+	}
+
+	// Shadow test of the rays of a packet, ray i is blocked by a hit closer than t_max[i].
+	// Only the rays in activeMask are tested, returns the bit mask of the blocked rays.
+	// The default tests the rays one by one.
+	virtual int IntersectShadowPacket( const RayPacket &packet, const float *t_max, int activeMask ) const
+	{
+		int occludedMask = 0;
+		for ( int i=0; i<packet.size; i++ ) {
+			if ( ( activeMask & (1<<i) ) && IntersectShadow( packet.ray[i], t_max[i] ) ) occludedMask |= 1<<i;
+		}
+		return occludedMask;
+	}
 	virtual void ViewportDisplay(const Material *mtl) const {}	// used for OpenGL display
 };
 
@@ -289,6 +419,11 @@ public:
 	virtual bool	IsPhotonSource()		const { return false; }
 	virtual Color	GetPhotonIntensity()	const { return Color(0,0,0); }
 	virtual Ray		RandomPhoton()			const { return Ray(Point3(0,0,0),Point3(0,0,1)); }
+
+	// Wavefront Extensions
+	// Returns the light arriving at p without shadows. If the light can be occluded, shadowRay and shadowT
+	// are set to the ray and distance that decide its visibility, otherwise shadowT is set to zero.
+	virtual Color	SampleIllumination(const Point3 &p, Ray &shadowRay, float &shadowT) const { shadowT=0; return Illuminate(p,Point3(0,0,0)); }
 };
 
 class LightList : public ItemList<Light> {};
@@ -302,13 +437,28 @@ public:
 	// ray: incoming ray,
 	// hInfo: hit information for the point that is being shaded, lights: the light list,
 	// bounceCount: permitted number of additional bounces for reflection and refraction.
-	virtual Color Shade(const Ray &ray, const HitInfo &hInfo, const LightList &lights, int bounceCount) const=0;
+	virtual Color Shade(const Ray &ray, const HitInfo &hInfo, const LightList &lights, int bounceCount) const { return Shade(ray,hInfo,lights,bounceCount,Color(0,0,0)); }
+
+	// Same as above, with indirect irradiance at the hit point (e.g. from Monte Carlo bounces) passed by value.
+	// It is shaded like an ambient light, so no light list has to be built for it.
+	virtual Color Shade(const Ray &ray, const HitInfo &hInfo, const LightList &lights, int bounceCount, const Color &indirect) const=0;
 
 	virtual void SetViewportMaterial(int subMtlID=0) const {}	// used for OpenGL display
 
 	// Photon Extensions
 	virtual bool IsPhotonSurface(int subMtlID=0) const { return true; }	// if this method returns true, the photon will be stored
 	virtual bool RandomPhotonBounce(Ray &r, Color &c, HitInfo &hInfo) const { return false; }	// if this method returns true, a new photon with the given direction and color will be traced
+
+	// Wavefront Extensions
+	// The wavefront renderer evaluates Shade() in parts, so that the rays it needs can be queued and traced in bulk.
+	// PathTrace() uses the same parts, but follows only one of the rays at each hit.
+	// ShadeLight: light reflected towards the viewer from a light, given the light arriving at the hit point.
+	// GetIndirectWeight: weight of the indirect irradiance in Shade().
+	// GetSecondaryRays: reflection and refraction rays of Shade(), returns the number of rays written to rays.
+	enum { MAX_SECONDARY_RAYS = 3 };
+	virtual Color ShadeLight(const HitInfo &hInfo, const Light *light, const Color &illumination) const { return Color(0,0,0); }
+	virtual Color GetIndirectWeight(const HitInfo &hInfo) const { return Color(0,0,0); }
+	virtual int   GetSecondaryRays(const Ray &ray, const HitInfo &hInfo, SecondaryRay *rays) const { return 0; }
 };
 
 class MaterialList : public ItemList<Material>
@@ -503,6 +653,7 @@ public:
 		Ray r;
 		r.p   = TransformTo(ray.p);
 		r.dir = TransformTo(ray.p + ray.dir) - r.p;
+		r.UpdateInverse();
 		return r;
 	}
 	void FromNodeCoords( HitInfo &hInfo ) const
@@ -542,7 +693,7 @@ private:
 	Color24	*img;
 	float	*zbuffer;
 	uchar	*zbufferImg;
-	uchar	*sampleCount;
+	int		*sampleCount;
 	uchar	*sampleCountImg;
 	uchar	*irradComp;
 	int		width, height;
@@ -560,7 +711,7 @@ public:
 		if (zbufferImg) delete [] zbufferImg;
 		zbufferImg = NULL;
 		if ( sampleCount ) delete [] sampleCount;
-		sampleCount = new uchar[width*height];
+		sampleCount = new int[width*height];
 		if ( sampleCountImg ) delete [] sampleCountImg;
 		sampleCountImg = NULL;
 		if ( irradComp ) delete [] irradComp;
@@ -578,7 +729,7 @@ public:
 	Color24*	GetPixels()			{ return img; }
 	float*		GetZBuffer()		{ return zbuffer; }
 	uchar*		GetZBufferImage()	{ return zbufferImg; }
-	uchar*		GetSampleCount()	{ return sampleCount; }
+	int*		GetSampleCount()	{ return sampleCount; }
 	uchar*		GetSampleCountImage(){ return sampleCountImg; }
 	uchar*		GetIrradianceComputationImage() { return irradComp; }
 
@@ -617,7 +768,7 @@ public:
 		if (sampleCountImg) delete [] sampleCountImg;
 		sampleCountImg = new uchar[size];
 
-		uchar smin=255, smax=0;
+		int smin=sampleCount[0], smax=0;
 		for ( int i=0; i<size; i++ ) {
 			if ( smin > sampleCount[i] ) smin = sampleCount[i];
 			if ( smax < sampleCount[i] ) smax = sampleCount[i];
@@ -18,6 +18,7 @@
 #include "lights.h"
 #include "materials.h"
 #include "texture.h"
+#include "../RandomGenerator.h"
 #include <stdlib.h>
 #include <time.h>
 
@@ -234,8 +235,10 @@ void DrawScene()
 	Point3 u = camera.up;
 	if ( camera.dof > 0 ) {
 		Point3 v = camera.dir ^ camera.up;
-		float r = sqrtf(float(rand())/RAND_MAX)*camera.dof;
-		float a = float(M_PI) * 2.0f * float(rand())/RAND_MAX;
+		float jitter[2];
+		Random().NextFloats( jitter, 2 );
+		float r = sqrtf(jitter[0])*camera.dof;
+		float a = float(M_PI) * 2.0f * jitter[1];
 		p += r*cosf(a)*v + r*sinf(a)*u;
 	}
 	gluLookAt( p.x, p.y, p.z,  t.x, t.y, t.z,  u.x, u.y, u.z );
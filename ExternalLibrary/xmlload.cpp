@@ -200,13 +200,22 @@ void LoadNode(Node *parent, TiXmlElement *element, int level)
 			printf(" - OBJ");
 			Object *obj = objList.Find(name);
 			if ( obj == NULL ) {	// object is not on the list, so we should load it now
+				// BVH split method: mean (default), sah (binned) or sweep (full sweep SAH)
+				cyBVH::SplitMethod bvhSplit = cyBVH::SPLIT_MEAN;
+				const char* bvhType = element->Attribute("bvh");
+				if ( bvhType ) {
+					if ( COMPARE(bvhType,"sah") ) bvhSplit = cyBVH::SPLIT_SAH_BINNED;
+					else if ( COMPARE(bvhType,"sweep") ) bvhSplit = cyBVH::SPLIT_SAH_SWEEP;
+					else if ( ! COMPARE(bvhType,"mean") ) printf(" -- WARNING: Unknown BVH type \"%s\", using mean.", bvhType);
+				}
 				TriObj *tobj = new TriObj;
-				if ( ! tobj->Load( name, mtlName==NULL ) ) {
+				if ( ! tobj->Load( name, mtlName==NULL, bvhSplit ) ) {
 					printf(" -- ERROR: Cannot load file \"%s.\"", name);
 					delete tobj;
 				} else {
 					objList.Append(tobj,name);	// add to the list
 					obj = tobj;
+					printf(" - BVH SAH cost %f", tobj->GetBVH().GetSAHCost());
 					// generate multi-material
 					if ( tobj->NM() > 0 ) {
 						if ( materials.Find(name) == NULL ) {
@@ -0,0 +1,96 @@
+//
+//  RandomGenerator.h
+//  RayTracerXcode
+//
+
+#ifndef RandomGenerator_h
+#define RandomGenerator_h
+
+#include <atomic>
+#include <stdint.h>
+
+//PCG32 random number generator (O'Neill, "PCG: A Family of Simple Fast Space-Efficient
+//Statistically Good Algorithms for Random Number Generation")
+//A 64 bit linear congruential state with a permuted 32 bit output, the stream selects the increment,
+//so generators with the same seed and different streams never share a sequence
+//
+//For values that are not part of a sample, the camera, light and bounce samples come from Sampler
+class RandomGenerator
+{
+private:
+    uint64_t state;
+    uint64_t increment;
+
+    static const uint64_t MULTIPLIER = 6364136223846793005ULL;
+    static const int BATCH_SIZE = 16;
+
+public:
+    RandomGenerator(uint64_t seed = 0, uint64_t stream = 0) { Seed(seed, stream); }
+
+    //Restarts the generator, the same (seed, stream) pair always generates the same numbers
+    void Seed(uint64_t seed, uint64_t stream = 0)
+    {
+        increment = (stream << 1) | 1;
+        state = 0;
+        Step();
+        state += seed;
+        Step();
+    }
+
+    uint32_t Next()
+    {
+        uint64_t old = state;
+        Step();
+        return Output(old);
+    }
+
+    //Uniform float in [0,1)
+    float NextFloat() { return ToFloat(Next()); }
+
+    //Fills out with n uniform floats in [0,1)
+    //Only the state update depends on the previous number, the states of a batch are stepped first,
+    //then the output permutation and the conversion run over the batch in a loop that can be vectorized
+    void NextFloats(float* out, int n)
+    {
+        uint64_t states[BATCH_SIZE];
+
+        while (n > 0) {
+            int count = (n < BATCH_SIZE) ? n : BATCH_SIZE;
+
+            for (int i = 0; i < count; i++) {
+                states[i] = state;
+                Step();
+            }
+            for (int i = 0; i < count; i++) {
+                out[i] = ToFloat(Output(states[i]));
+            }
+
+            out += count;
+            n -= count;
+        }
+    }
+
+private:
+    void Step() { state = state * MULTIPLIER + increment; }
+
+    //XSH RR, the top bits of the state select a rotation of the xorshifted high bits
+    static uint32_t Output(uint64_t s)
+    {
+        uint32_t xorshifted = (uint32_t)(((s >> 18) ^ s) >> 27);
+        uint32_t rotation = (uint32_t)(s >> 59);
+        return (xorshifted >> rotation) | (xorshifted << ((32 - rotation) & 31));
+    }
+
+    //Uses the upper 24 bits, so the result is never rounded up to 1
+    static float ToFloat(uint32_t x) { return (float)(x >> 8) * (1.0f / 16777216.0f); }
+};
+
+//Generator of the calling thread, every thread starts on its own stream
+inline RandomGenerator& Random()
+{
+    static std::atomic<uint32_t> nextStream(0);
+    static thread_local RandomGenerator generator(0, nextStream++);
+    return generator;
+}
+
+#endif /* RandomGenerator_h */
@@ -8,332 +8,580 @@
 #include "ExternalLibrary/scene.h"
 #include "ExternalLibrary/objects.h"
 #include "ExternalLibrary/cyPhotonMap.h"
-#include "PixelIterator.h"
+#include "TileIterator.h"
+#include "SceneBVH.h"
 #include "RenderFunctions.h"
+#include "Sampling.h"
+#include "SampleAccumulator.h"
+#include "CameraRayGenerator.h"
+#include "RenderThreadPool.h"
+#include "WavefrontRenderer.h"
 #include <array>
+#include <chrono>
 
 //Variables
-extern Node rootNode;
+extern SceneBVH sceneBVH;
 extern Camera camera;
+extern CameraRayGenerator cameraRays;
 extern RenderImage renderImage;
 extern MaterialList materials;
 extern LightList lights;
 extern TexturedColor background;
-
-float actualHeight, actualWidth;
+extern RenderThreadPool renderPool;
+extern WavefrontRenderer wavefrontRenderer;
 
 //Render Parameters
 const int minSampleSize = 8;
 const int maxSampleSize = 1024;
-const float targetVariance = 0.005;
+const float targetVariance = 0.0001;
 const int sampleIncrement = 1;
+const int sampleBatchSize = 8;          //Samples traced before they are shaded, keeps the batch in L1
+const int wavefrontPixelsPerWave = 4096;    //Pixels whose paths are queued together by the wavefront renderer, keeps the queues in L2/L3
 const int monteCarloSampleSize = 1;
 const int monteCarloBounces = 4;
+const Color lastBounceIrradiance = Color(0.1, 0.1, 0.1);   //Indirect light after the last Monte Carlo bounce
+const int specularBounceCount = 5;        //Reflection and refraction bounces, reset by each Monte Carlo bounce
+const int russianRouletteDepth = 2;       //Bounces before Russian roulette may end a path
+const float russianRouletteThreshold = 0.1;   //Paths with a higher throughput are never ended by Russian roulette
 const int photonMapSize = 1000000;
 const int photonSampleSize = 100;
 const int photonMaxBounce = 10;
 const float photonEstRadius = 1;
 const float photonEllipticity = 0.5;
-
-//Sampling Variables
-int HaltonIndex = 0;
+const int cameraSampleDimensions = 2;     //Pixel offset and lens, the shading dimensions start after them
+const unsigned int randomSeed = 0;
 
 cyPhotonMap pMap;
 
 //Prototypes
-Point3 CalculateImageOrigin(float distanceToImg);
-Point3 CalculateCurrentPoint(int i, int j, float pixelOffsetX, float pixelOffsetY, Point3 origin);
+void RenderPixel(int x, int y);
 Ray CalculateReflectedRay(const Ray incomingRay, const HitInfo &hInfo, const float reflectionGlossiness);
 Ray CalculateRefractedRay(const Ray incomingRay, const HitInfo &hInfo, const float refractionGlossiness, const float ior);
 Color PhotonMapping(const Ray &r, const HitInfo &hInfo);
 Color MonteCarloPhoton(const HitInfo &hInfo, int x, int y, int numOfSamples);
-//void MonteCarlo(LightList &copiedList, const Ray &r, const HitInfo &hInfo, int x, int y, int bounces, int numOfSamples);
-void MonteCarlo(LightList &copiedList, const HitInfo &hInfo, int x, int y, int bounces, int numOfSamples);
-Color PathTrace(const HitInfo &hInfo, int x, int y, int bounces);
+Color PathTrace(const Ray &r, const HitInfo &hInfo, int bounces, const Color &hitDirectLight);
 
 //Main Render Function
-void Render(PixelIterator& i)
+//Claim tiles until the image is done, each thread renders whole tiles
+void Render(TileIterator& i)
 {
-    Point3 imgOrigin;
-    int x, y;
-    
-    srand(time(NULL));
-    
-    while (i.GetPixelLocation(x, y)) {
-//        if (x == 403 && y == 323) {
-//            int j = 0;
-//        }
-        
-        //Sample Array
-        std::array<Ray, maxSampleSize> rayArray;
-        std::array<HitInfo, maxSampleSize> hitInfoArray;
-        std::array<bool, maxSampleSize> hitResult;
-        float pixelIncrement = 1.0/maxSampleSize;
-        bool hitResultSum = false;
-        float zSum = 0.0;
-        int numOfHits = 0;
-        
-        //Populate the two hitinfo array
-        for (int index = 0; index < maxSampleSize; index++) {
-            imgOrigin = CalculateImageOrigin(camera.focaldist);
-            
-            //Generate offset for current sample
-            float currentOffset = index * pixelIncrement;
-//            float offsetX = static_cast <float> (rand()) / (static_cast <float> (RAND_MAX/pixelIncrement));
-//            float offsetY = static_cast <float> (rand()) / (static_cast <float> (RAND_MAX/pixelIncrement));
-            float offsetX = Halton(index, 4);
-            float offsetY = Halton(index, 5);
-            
-            //Generate random sample
-            float sampleX = static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
-            float sampleTheta = static_cast <float> (rand()) / (static_cast <float> (RAND_MAX/(2 * M_PI)));
-            float camOffsetX = sqrt(sampleX * camera.dof * camera.dof) * cos(sampleTheta);
-            float camOffsetY = sqrt(sampleX * camera.dof * camera.dof) * sin(sampleTheta);
-            
-            Point3 sampledPosition = camera.pos + camera.up * camOffsetY + camera.dir.GetNormalized().Cross(camera.up.GetNormalized()).GetNormalized() * camOffsetX;
-            
-            //Find current point and generate ray
-            Point3 currentPoint = CalculateCurrentPoint(x, y, currentOffset+offsetX, currentOffset+offsetY, imgOrigin);
-            rayArray[index] = Ray(sampledPosition, (currentPoint - sampledPosition).GetNormalized());
-            
-            //Everything is stored in World Coordinate
-            hitInfoArray[index] = HitInfo();
-            
-            //Trace ray with each object
-            bool currentResult = Trace(rayArray[index], &rootNode, hitInfoArray[index]);
-            
-            hitResult[index] = currentResult;
-            hitResultSum |= currentResult;
-            
-            if (currentResult) {
-                zSum += hitInfoArray[index].z;
-                numOfHits++;
+    TileIterator::Tile tile;
+    
+    while (i.GetTile(tile)) {
+        auto tileStart = std::chrono::steady_clock::now();
+        
+        for (int y = tile.y0; y < tile.y1; y++) {
+            for (int x = tile.x0; x < tile.x1; x++) {
+                RenderPixel(x, y);
             }
         }
+        
+        //Wall clock time, cyTimer measures the CPU time of the whole process
+        std::chrono::duration<float> tileTime = std::chrono::steady_clock::now() - tileStart;
+        i.FinishTile(tile, tileTime.count());
+    }
+}
 
-        int imgArrayIndex = x+renderImage.GetWidth()*y;
-//        renderImage.GetZBuffer()[imgArrayIndex] = zSum / (float)numOfHits;
+//Render a single pixel with adaptive sampling
+void RenderPixel(int x, int y)
+{
+    //One sample sequence per pixel, so the image does not depend on which thread renders the pixel
+    Sampler& sampler = CurrentSampler();
+    sampler.StartPixel(randomSeed, x+renderImage.GetWidth()*y);
+    
+    //Sample arrays of one batch, the size does not depend on maxSampleSize
+    std::array<Point2, sampleBatchSize> pixelOffsets;
+    std::array<Point2, sampleBatchSize> lensSamples;
+    std::array<Ray, sampleBatchSize> rayArray;
+    std::array<HitRecord, sampleBatchSize> hitArray;
+    std::array<bool, sampleBatchSize> hitResult;
+    std::array<HitInfo, sampleBatchSize> hitInfos;
+    std::array<Color, sampleBatchSize> directLight;
+    std::array<uint32_t, sampleBatchSize> pathDimensions;
+    float zSum = 0.0;
+    int numOfHits = 0;
+    
+    //Every shaded sample is streamed into the accumulator
+    SampleAccumulator pixel;
+    int sampleCount = 0;
+    
+    //Adaptive Sampling
+    //Start with minSampleSize samples, then keep adding sampleIncrement samples
+    //until the variance of the pixel estimate drops below targetVariance
+    while (sampleCount < maxSampleSize) {
+        int batchSize = (sampleCount < minSampleSize) ? minSampleSize - sampleCount : sampleIncrement;
+        if (batchSize > sampleBatchSize) {
+            batchSize = sampleBatchSize;
+        }
+        int batchEnd = (sampleCount + batchSize < maxSampleSize) ? sampleCount + batchSize : maxSampleSize;
         
-        //If hit, perform Monte Carlo, then shade the pixel
-        if (hitResultSum) {
-            
-            Color pixelValuesSum = Color(0.0, 0.0, 0.0);
-            std::array<Color, maxSampleSize> pixelValueArray;
+        //Pixel offset and lens sample of each sample in the batch
+        for (int index = sampleCount; index < batchEnd; index++) {
+            sampler.StartSample(index);
+            pixelOffsets[index - sampleCount] = sampler.Get2D();
+            lensSamples[index - sampleCount] = sampler.Get2D();
+        }
+        
+        //Generate the camera rays of the whole batch
+        cameraRays.GetRays(x, y, pixelOffsets.data(), lensSamples.data(), rayArray.data(), batchEnd - sampleCount);
+        
+        //Only the hit records are kept for the batch, the hitinfo is filled in when a sample is shaded
+        for (int b = 0; b < batchEnd - sampleCount; b++) {
+            hitArray[b] = HitRecord();
+        }
+        
+        //The camera rays of a pixel are coherent, trace the whole batch as one packet
+        TracePacket(rayArray.data(), hitArray.data(), hitResult.data(), batchEnd - sampleCount);
+        
+        for (int b = 0; b < batchEnd - sampleCount; b++) {
+            if (hitResult[b]) {
+                zSum += hitArray[b].z;
+                numOfHits++;
+            }
+        }
+        
+        //Everything is stored in World Coordinate
+        for (int b = 0; b < batchEnd - sampleCount; b++) {
+            if (hitResult[b]) {
+                GetHitInfo(rayArray[b], hitArray[b], hitInfos[b]);
+                directLight[b] = Color(0.0, 0.0, 0.0);
+                pathDimensions[b] = cameraSampleDimensions;
+            }
+        }
+        
+        //Direct light at the hits of the batch, in the sampler dimensions of the first hit of PathTrace
+        //The shadow rays of the batch go to the same light, so they are traced as one packet per light
+        for (size_t l = 0; l < lights.size(); l++) {
+            Ray shadowRays[sampleBatchSize];
+            float shadowT[sampleBatchSize];
+            Color illumination[sampleBatchSize];
+            bool occluded[sampleBatchSize];
+            int shadowSample[sampleBatchSize];
+            int numOfShadowRays = 0;
             
-            // Shading Calculation
-            for (int index = 0; index < maxSampleSize; index++) {
-                Color currentResult = Color(0.0, 0.0, 0.0);
-                
-                if (hitResult[index]) {
-                    // Copy and Construct a new light list for monte carlo
-                        LightList monteCarloList;
-
-                    // Monte Carlo
-                        MonteCarlo(monteCarloList, hitInfoArray[index], x, y, monteCarloBounces, monteCarloSampleSize);
-
-                        currentResult = hitInfoArray[index].node->GetMaterial()->Shade(rayArray[index], hitInfoArray[index], monteCarloList, 5);
-                        currentResult += hitInfoArray[index].node->GetMaterial()->Shade(rayArray[index], hitInfoArray[index], lights, 5);
-                    
-                    // Photon Map + MonteCarlo
-//                        currentResult += hitInfoArray[index].node->GetMaterial()->Shade(rayArray[index], hitInfoArray[index], lights, 5);
-//                        currentResult += MonteCarloPhoton(hitInfoArray[index], x, y, monteCarloSampleSize);
-                    
-                    // Photon Map
-//                    currentResult = PhotonMapping(rayArray[index], hitInfoArray[index]);
-                }
-                else {
-                    currentResult = background.Sample(Point3((float)x/camera.imgWidth, (float)y/camera.imgHeight, 0));
+            for (int b = 0; b < batchEnd - sampleCount; b++) {
+                if (!hitResult[b]) {
+                    continue;
                 }
                 
-                pixelValuesSum += currentResult;
-                pixelValueArray[index] = currentResult;
+                sampler.StartSample(sampleCount + b, pathDimensions[b]);
+                illumination[b] = lights[l]->SampleIllumination(hitInfos[b].p, shadowRays[numOfShadowRays], shadowT[numOfShadowRays]);
+                pathDimensions[b] = sampler.GetDimension();
+                occluded[b] = false;
+                
+                if (shadowT[numOfShadowRays] > 0) {
+                    shadowSample[numOfShadowRays++] = b;
+                }
             }
             
-            pixelValuesSum /= (float)maxSampleSize;
-            
-            // Gamma Correction
-            pixelValuesSum.r = pow(pixelValuesSum.r, 1/2.2);
-            pixelValuesSum.g = pow(pixelValuesSum.g, 1/2.2);
-            pixelValuesSum.b = pow(pixelValuesSum.b, 1/2.2);
+            bool shadowResult[sampleBatchSize];
+            ShadowTracePacket(shadowRays, shadowT, shadowResult, numOfShadowRays);
+            for (int i = 0; i < numOfShadowRays; i++) {
+                occluded[shadowSample[i]] = shadowResult[i];
+            }
             
-            renderImage.GetPixels()[imgArrayIndex] = Color24(pixelValuesSum);
-            renderImage.IncrementNumRenderPixel(1);
+            for (int b = 0; b < batchEnd - sampleCount; b++) {
+                if (hitResult[b]) {
+                    Color visible = occluded[b] ? Color(0.0, 0.0, 0.0) : illumination[b];
+                    directLight[b] += hitInfos[b].node->GetMaterial()->ShadeLight(hitInfos[b], lights[l], visible);
+                }
+            }
         }
-        //Else, Sample background
-        else {
-            Color result = background.Sample(Point3((float)x/camera.imgWidth, (float)y/camera.imgHeight, 0));
-
-            result.r = pow(result.r, 1/2.2);
-            result.g = pow(result.g, 1/2.2);
-            result.b = pow(result.b, 1/2.2);
+        
+        // Shading Calculation
+        for (int index = sampleCount; index < batchEnd; index++) {
+            int b = index - sampleCount;
+            Color currentResult = Color(0.0, 0.0, 0.0);
+            
+            //If hit, perform Monte Carlo, then shade the sample
+            if (hitResult[b]) {
+                //The path continues after the light samples of its first hit
+                sampler.StartSample(index, pathDimensions[b]);
+                
+                // Path Tracing
+                currentResult = PathTrace(rayArray[b], hitInfos[b], monteCarloBounces, directLight[b]);
+                
+                // Photon Map + MonteCarlo
+//                        currentResult += hInfo.node->GetMaterial()->Shade(rayArray[b], hInfo, lights, 5);
+//                        currentResult += MonteCarloPhoton(hInfo, x, y, monteCarloSampleSize);
+                
+                // Photon Map
+//                    currentResult = PhotonMapping(rayArray[b], hInfo);
+            }
+            //Else, Sample background
+            else {
+                currentResult = background.Sample(Point3((float)x/camera.imgWidth, (float)y/camera.imgHeight, 0));
+            }
             
-            renderImage.GetPixels()[imgArrayIndex] = Color24(result);
-            renderImage.IncrementNumRenderPixel(1);
+            pixel.Add(currentResult);
+        }
+        
+        sampleCount = batchEnd;
+        
+        //Stop once the variance of the mean is below the target
+        if (sampleCount >= minSampleSize && pixel.VarianceOfMean() < targetVariance) {
+            break;
         }
-
     }
+
+//        renderImage.GetZBuffer()[x+renderImage.GetWidth()*y] = zSum / (float)numOfHits;
+    
+    StorePixel(x, y, pixel.Mean(), sampleCount);
+}
+
+//Writes the final color of a pixel to the render image
+void StorePixel(int x, int y, Color pixelValuesSum, int sampleCount)
+{
+    int imgArrayIndex = x+renderImage.GetWidth()*y;
+    
+    // Gamma Correction
+    pixelValuesSum.r = pow(pixelValuesSum.r, 1/2.2);
+    pixelValuesSum.g = pow(pixelValuesSum.g, 1/2.2);
+    pixelValuesSum.b = pow(pixelValuesSum.b, 1/2.2);
     
+    renderImage.GetPixels()[imgArrayIndex] = Color24(pixelValuesSum);
+    renderImage.GetSampleCount()[imgArrayIndex] = sampleCount;
+    renderImage.IncrementNumRenderPixel(1);
+}
+
+//Wavefront Render Function
+//Renders the whole frame with queues of rays per stage, using the render parameters of RenderPixel
+//The stages run on the workers of the render pool, so it is called from outside the pool
+void RenderWavefront(TileIterator& i)
+{
+    WavefrontRenderer::Settings settings;
+    settings.minSamples = minSampleSize;
+    settings.maxSamples = maxSampleSize;
+    settings.sampleIncrement = sampleIncrement;
+    settings.targetVariance = targetVariance;
+    settings.diffuseBounces = monteCarloBounces;
+    settings.specularBounces = specularBounceCount;
+    settings.lastBounceIrradiance = lastBounceIrradiance;
+    settings.seed = randomSeed;
+    settings.cameraSampleDimensions = cameraSampleDimensions;
+    settings.pixelsPerWave = wavefrontPixelsPerWave;
+    
+    wavefrontRenderer.Render(i, renderPool, settings);
 }
 
+//Node of the scene BVH waiting on the traversal stack
+struct SceneStackEntry
+{
+    unsigned int node;
+    float tEntry;   //Distance where the ray enters the node box
+};
+
 //Ray Tracing Logic
-//Recurse through all child nodes,
-//If an object exist, intersect ray, fill in hitinfo
-bool Trace(const Ray& r, Node* currentNode, HitInfo& hInfo)
+//Finds the closest hit and fills in hitinfo in world coord
+bool Trace(const Ray& r, HitInfo& hInfo)
 {
-    bool currentNodeIsHit = false;
-    
-    //If current node has an object, intersect and check children
-    if (currentNode->GetNodeObj() != nullptr) {
-        currentNodeIsHit = currentNode->GetNodeObj()->IntersectRay(currentNode->ToNodeCoords(r), hInfo);
-        if (currentNodeIsHit) {
-//            const char* sresult = currentNode->GetName();
-//            const char* compare = "/Users/Peter/GitRepos/RayTracer-Utah/SceneFiles/Project5/teapot-low.obj";
-//            if (strcmp(sresult, compare )==0) {
-//                int x = 1;
-//            }
-            
-            hInfo.node = currentNode;
-            //Convert everything back to world coord
-            currentNode->FromNodeCoords(hInfo);
-        }
-    }
+    HitRecord hit;
+    hit.z = hInfo.z;
     
-    //Keep testing children
-    if (currentNode->GetNumChild() > 0) {
-        for (int i = 0; i < currentNode->GetNumChild(); i++) {
-            bool childIsHit = Trace(currentNode->ToNodeCoords(r), currentNode->GetChild(i), hInfo);
-            if (childIsHit) {
-                currentNode->FromNodeCoords(hInfo);
-            }
-            currentNodeIsHit = currentNodeIsHit | childIsHit;
-        }
+    if (!TraceHit(r, hit)) {
+        return false;
     }
     
-    return currentNodeIsHit;
+    GetHitInfo(r, hit, hInfo);
+    return true;
 }
 
-//Shadow Trace function
-bool ShadowTrace(const Ray& r, Node* currentNode, HitInfo& hInfo)
+//Traverse the top level BVH of the scene front to back,
+//If an instance box is hit, intersect its object in object space
+//Only the hit record of the closest hit is kept, see GetHitInfo()
+bool TraceHit(const Ray& r, HitRecord& hit)
 {
-    bool currentNodeIsHit = false;
+    bool isHit = false;
     
-    //If current node has an object, intersect and check children
-    if (currentNode->GetNodeObj() != nullptr) {
-        currentNodeIsHit = currentNode->GetNodeObj()->IntersectRay(currentNode->ToNodeCoords(r), hInfo);
-        if (currentNodeIsHit) {
-            return true;
-        }
+    if (sceneBVH.GetNumInstances() == 0) {
+        return false;
+    }
+    
+    //Reuse the stack memory of the thread between rays
+    static thread_local std::vector<SceneStackEntry> traceStack;
+    traceStack.clear();
+    
+    SceneStackEntry root = {sceneBVH.GetRootNodeID(), 0.0f};
+    if (Box(sceneBVH.GetNodeBounds(root.node)).IntersectRay(r, hit.z, root.tEntry)) {
+        traceStack.push_back(root);
     }
     
-    //Keep testing children
-    if (currentNode->GetNumChild() > 0) {
-        for (int i = 0; i < currentNode->GetNumChild(); i++) {
-            bool childIsHit = ShadowTrace(currentNode->ToNodeCoords(r), currentNode->GetChild(i), hInfo);
-            if (childIsHit) {
-                return true;
+    while (!traceStack.empty()) {
+        SceneStackEntry current = traceStack.back();
+        traceStack.pop_back();
+        
+        //Skip nodes that start behind the closest hit found so far
+        if (current.tEntry >= hit.z) {
+            continue;
+        }
+        
+        if (!sceneBVH.IsLeafNode(current.node)) {
+            SceneStackEntry children[2] = {{sceneBVH.GetFirstChildNode(current.node), 0.0f},
+                                           {sceneBVH.GetSecondChildNode(current.node), 0.0f}};
+            bool childHit[2];
+            for (int i = 0; i < 2; i++) {
+                childHit[i] = Box(sceneBVH.GetNodeBounds(children[i].node)).IntersectRay(r, hit.z, children[i].tEntry);
+            }
+            
+            //Push the farther child first, so that the nearer one is visited first
+            int nearer = (children[1].tEntry < children[0].tEntry) ? 1 : 0;
+            if (childHit[1 - nearer]) {
+                traceStack.push_back(children[1 - nearer]);
+            }
+            if (childHit[nearer]) {
+                traceStack.push_back(children[nearer]);
+            }
+        }
+        //Intersect with each instance in the leaf node
+        else {
+            unsigned int firstInstance = sceneBVH.GetNodeFirstInstance(current.node);
+            
+            for (unsigned int i = firstInstance; i < firstInstance + sceneBVH.GetNodeElementCount(current.node); i++) {
+                const SceneInstanceTransform& instance = sceneBVH.GetInstanceTransform(i);
+                
+                if (instance.obj->IntersectHit(instance.ToObjectCoords(r), hit)) {
+                    hit.instance = i;
+                    isHit = true;
+                }
             }
-            currentNodeIsHit = currentNodeIsHit | childIsHit;
         }
     }
     
-    return currentNodeIsHit;
+    return isHit;
 }
 
-//Calculate the origin of the image in world space
-Point3 CalculateImageOrigin(float distanceToImg)
+//Fill in hitinfo of a hit found by TraceHit or TracePacket, then convert everything back to world coord
+void GetHitInfo(const Ray& r, const HitRecord& hit, HitInfo& hInfo)
 {
-    Point3 result, topCenterPoint;
-    
-    actualHeight = tan((camera.fov/2)*M_PI/180.0)*2*distanceToImg;
-    actualWidth = ((float)camera.imgWidth/(float)camera.imgHeight) * actualHeight;
-    
-    topCenterPoint = camera.pos + distanceToImg * camera.dir.GetNormalized() + (actualHeight/2)*camera.up.GetNormalized();
-    
-    result = topCenterPoint - (actualWidth/2)*(camera.dir.GetNormalized().Cross(camera.up.GetNormalized()).GetNormalized());
-    
-    return result;
+    const SceneInstanceTransform& instance = sceneBVH.GetInstanceTransform(hit.instance);
+    instance.obj->SetHitInfo(instance.ToObjectCoords(r), hit, hInfo);
+    hInfo.node = sceneBVH.GetInstance(hit.instance).node;
+    sceneBVH.GetInstance(hit.instance).FromObjectCoords(hInfo);
 }
 
-//Calculate the coord of the current point in world space
-Point3 CalculateCurrentPoint(int i, int j, float pixelOffsetX, float pixelOffsetY, Point3 origin)
+//Packet Tracing Logic
+//Trace a batch of coherent rays, such as the camera rays of a pixel, through the same nodes
+//A node is visited if any ray of the packet may hit it, with one interval test for the whole packet
+//Single rays and rays that go into different octants fall back to TraceHit
+//Like TraceHit, only the hit records are found, each ray keeps its own closest hit in hits
+void TracePacket(const Ray* rays, HitRecord* hits, bool* hitResult, int n)
 {
-    //U, V are verctors in direction of x and y at the length of one unit pixel
-    Point3 result, u, v;
-    
-    u = (camera.dir.GetNormalized().Cross(camera.up.GetNormalized())).GetNormalized()*(actualWidth/(float)camera.imgWidth);
-    v = (-1*(camera.up.GetNormalized()))*(actualHeight/(float)camera.imgHeight);
+    RayPacket packet;
     
-    result = origin + (i + pixelOffsetX) * u + (j + pixelOffsetY) * v;
+    if (n < 2 || n > RayPacket::MAX_SIZE || sceneBVH.GetNumInstances() == 0 || !packet.Set(rays, n)) {
+        for (int i = 0; i < n; i++) {
+            hitResult[i] = TraceHit(rays[i], hits[i]);
+        }
+        return;
+    }
     
-    return result;
-}
-
-//Sample a disk
-Point2 SampleDisk(float radius)
-{
-    float sampleX = static_cast <float> (rand()) / (static_cast <float> (RAND_MAX/1.0));
-    float sampleTheta = static_cast <float> (rand()) / (static_cast <float> (RAND_MAX/(2 * M_PI)));
+    //Farthest closest hit of the packet, nodes beyond it cannot improve any ray
+    float packetT = 0;
+    for (int i = 0; i < n; i++) {
+        hitResult[i] = false;
+        packetT = hits[i].z > packetT ? hits[i].z : packetT;
+    }
     
-    return Point2(sqrt(sampleX * camera.dof * camera.dof) * cos(sampleTheta),
-                  sqrt(sampleX * camera.dof * camera.dof) * sin(sampleTheta));
-}
-
-//Sample a sphere
-Point3 SampleSphere(Point3 origin, float radius)
-{
-//    float rand1 = Halton(HaltonIndex, 4) * radius;
-//    HaltonIndex++;
-//    float rand2 = Halton(HaltonIndex, 5) * radius;
-//    HaltonIndex++;
-//    float rand3 = Halton(HaltonIndex, 6) * radius;
-//    HaltonIndex++;
-    
-    float rand1 = -radius + static_cast <float> (rand()) /( static_cast <float> (RAND_MAX/(radius*2)));;
-    float rand2 = -radius + static_cast <float> (rand()) /( static_cast <float> (RAND_MAX/(radius*2)));;
-    float rand3 = -radius + static_cast <float> (rand()) /( static_cast <float> (RAND_MAX/(radius*2)));;
-
-    Point3 offset = Point3(rand1,rand2,rand3);
+    static thread_local std::vector<SceneStackEntry> traceStack;
+    traceStack.clear();
     
-    if (offset.Length() > radius) {
-        offset = SampleSphere(origin, radius);
+    SceneStackEntry root = {sceneBVH.GetRootNodeID(), 0.0f};
+    if (Box(sceneBVH.GetNodeBounds(root.node)).IntersectPacket(packet, packetT, root.tEntry)) {
+        traceStack.push_back(root);
     }
     
-    return offset;
+    while (!traceStack.empty()) {
+        SceneStackEntry current = traceStack.back();
+        traceStack.pop_back();
+        
+        if (current.tEntry >= packetT) {
+            continue;
+        }
+        
+        if (!sceneBVH.IsLeafNode(current.node)) {
+            SceneStackEntry children[2] = {{sceneBVH.GetFirstChildNode(current.node), 0.0f},
+                                           {sceneBVH.GetSecondChildNode(current.node), 0.0f}};
+            bool childHit[2];
+            for (int i = 0; i < 2; i++) {
+                childHit[i] = Box(sceneBVH.GetNodeBounds(children[i].node)).IntersectPacket(packet, packetT, children[i].tEntry);
+            }
+            
+            int nearer = (children[1].tEntry < children[0].tEntry) ? 1 : 0;
+            if (childHit[1 - nearer]) {
+                traceStack.push_back(children[1 - nearer]);
+            }
+            if (childHit[nearer]) {
+                traceStack.push_back(children[nearer]);
+            }
+        }
+        else {
+            unsigned int firstInstance = sceneBVH.GetNodeFirstInstance(current.node);
+            
+            for (unsigned int e = firstInstance; e < firstInstance + sceneBVH.GetNodeElementCount(current.node); e++) {
+                const SceneInstanceTransform& instance = sceneBVH.GetInstanceTransform(e);
+                
+                Ray objectRays[RayPacket::MAX_SIZE];
+                for (int i = 0; i < n; i++) {
+                    objectRays[i] = instance.ToObjectCoords(packet.ray[i]);
+                }
+                
+                //The transformation may split the octant of the packet, then the rays go one by one
+                RayPacket objectPacket;
+                int hitMask = 0;
+                if (objectPacket.Set(objectRays, n)) {
+                    hitMask = instance.obj->IntersectPacket(objectPacket, hits);
+                }
+                else {
+                    for (int i = 0; i < n; i++) {
+                        if (instance.obj->IntersectHit(objectRays[i], hits[i])) {
+                            hitMask |= 1 << i;
+                        }
+                    }
+                }
+                
+                for (int i = 0; i < n; i++) {
+                    if (hitMask & (1 << i)) {
+                        hits[i].instance = e;
+                        hitResult[i] = true;
+                    }
+                }
+            }
+            
+            packetT = 0;
+            for (int i = 0; i < n; i++) {
+                packetT = hits[i].z > packetT ? hits[i].z : packetT;
+            }
+        }
+    }
 }
 
-//Sample a hemisphere
-
-Point3 SampleHemiSphere(Point3 origin, Point3 normal, float radius)
+//Shadow Trace function
+//Any hit closer than t_max blocks the light, so the nodes are not sorted by distance
+//and the traversal returns at the first occluder
+bool ShadowTrace(const Ray& r, float t_max)
 {
-    Point3 offset = SampleSphere(origin, radius);
+    if (sceneBVH.GetNumInstances() == 0) {
+        return false;
+    }
     
-    Point3 direction = offset.GetNormalized();
+    static thread_local std::vector<unsigned int> traceStack;
+    traceStack.clear();
+    traceStack.push_back(sceneBVH.GetRootNodeID());
     
-    if (direction.Dot(normal) < 0) {
-        offset = -offset;
+    while (!traceStack.empty()) {
+        unsigned int currentNodeIndex = traceStack.back();
+        traceStack.pop_back();
+        
+        if (!Box(sceneBVH.GetNodeBounds(currentNodeIndex)).IntersectRay(r, t_max)) {
+            continue;
+        }
+        
+        if (!sceneBVH.IsLeafNode(currentNodeIndex)) {
+            traceStack.push_back(sceneBVH.GetSecondChildNode(currentNodeIndex));
+            traceStack.push_back(sceneBVH.GetFirstChildNode(currentNodeIndex));
+        }
+        else {
+            unsigned int firstInstance = sceneBVH.GetNodeFirstInstance(currentNodeIndex);
+            
+            for (unsigned int i = firstInstance; i < firstInstance + sceneBVH.GetNodeElementCount(currentNodeIndex); i++) {
+                const SceneInstanceTransform& instance = sceneBVH.GetInstanceTransform(i);
+                
+                if (instance.obj->IntersectShadow(instance.ToObjectCoords(r), t_max)) {
+                    return true;
+                }
+            }
+        }
     }
     
-    return offset;
+    return false;
 }
 
-//Cosine Weighted Hemisphere
-Point3 SampleHemiSphereCosine(Point3 origin, Point3 normal, float radius)
+//Shadow Packet Tracing
+//Trace a batch of shadow rays towards the same light, such as the shadow rays of a pixel batch
+//The nodes are visited with the interval test of TracePacket, a blocked ray leaves the packet
+//and the traversal returns once every ray is blocked
+//Single rays and rays that go into different octants fall back to ShadowTrace
+void ShadowTracePacket(const Ray* rays, const float* t_max, bool* occluded, int n)
 {
-    Point3 offset;
+    RayPacket packet;
     
-    float sampleX = static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
-    float samplePhi = static_cast <float> (rand()) / (static_cast <float> (RAND_MAX/(2 * M_PI)));
-    float sampleTheta = 0.5 * acos(1 - 2*sampleX);
+    if (n < 2 || n > RayPacket::MAX_SIZE || sceneBVH.GetNumInstances() == 0 || !packet.Set(rays, n)) {
+        for (int i = 0; i < n; i++) {
+            occluded[i] = ShadowTrace(rays[i], t_max[i]);
+        }
+        return;
+    }
     
-    // Find two random vectors
-    Point3 v1 = normal.Cross(Point3(sampleX)).GetNormalized();
-    Point3 v2 = v1.Cross(normal).GetNormalized();
+    //Rays that are not blocked yet, and the farthest t_max among them
+    int activeMask = (1 << n) - 1;
+    float packetT = 0;
+    for (int i = 0; i < n; i++) {
+        occluded[i] = false;
+        packetT = t_max[i] > packetT ? t_max[i] : packetT;
+    }
     
-    offset = normal * (radius * cos(sampleTheta)) +
-             v1 * (radius * sin(sampleTheta) * cos(samplePhi)) +
-             v2 * (radius * sin(sampleTheta) * sin(samplePhi));
+    static thread_local std::vector<unsigned int> traceStack;
+    traceStack.clear();
+    traceStack.push_back(sceneBVH.GetRootNodeID());
     
-    return offset;
+    while (!traceStack.empty()) {
+        unsigned int currentNodeIndex = traceStack.back();
+        traceStack.pop_back();
+        
+        float tEntry;
+        if (!Box(sceneBVH.GetNodeBounds(currentNodeIndex)).IntersectPacket(packet, packetT, tEntry)) {
+            continue;
+        }
+        
+        if (!sceneBVH.IsLeafNode(currentNodeIndex)) {
+            traceStack.push_back(sceneBVH.GetSecondChildNode(currentNodeIndex));
+            traceStack.push_back(sceneBVH.GetFirstChildNode(currentNodeIndex));
+            continue;
+        }
+        
+        unsigned int firstInstance = sceneBVH.GetNodeFirstInstance(currentNodeIndex);
+        
+        for (unsigned int e = firstInstance; e < firstInstance + sceneBVH.GetNodeElementCount(currentNodeIndex); e++) {
+            const SceneInstanceTransform& instance = sceneBVH.GetInstanceTransform(e);
+            
+            Ray objectRays[RayPacket::MAX_SIZE];
+            for (int i = 0; i < n; i++) {
+                objectRays[i] = instance.ToObjectCoords(packet.ray[i]);
+            }
+            
+            //The transformation may split the octant of the packet, then the rays go one by one
+            RayPacket objectPacket;
+            int occludedMask = 0;
+            if (objectPacket.Set(objectRays, n)) {
+                occludedMask = instance.obj->IntersectShadowPacket(objectPacket, t_max, activeMask);
+            }
+            else {
+                for (int i = 0; i < n; i++) {
+                    if ((activeMask & (1 << i)) && instance.obj->IntersectShadow(objectRays[i], t_max[i])) {
+                        occludedMask |= 1 << i;
+                    }
+                }
+            }
+            
+            for (int i = 0; i < n; i++) {
+                if (occludedMask & (1 << i)) {
+                    occluded[i] = true;
+                }
+            }
+            activeMask &= ~occludedMask;
+            
+            if (activeMask == 0) {
+                return;
+            }
+        }
+        
+        packetT = 0;
+        for (int i = 0; i < n; i++) {
+            if (activeMask & (1 << i)) {
+                packetT = t_max[i] > packetT ? t_max[i] : packetT;
+            }
+        }
+    }
 }
 
 // PhotonMapping
@@ -341,10 +589,14 @@ Point3 SampleHemiSphereCosine(Point3 origin, Point3 normal, float radius)
 void GeneratePhotonMap()
 {
     pMap.Resize(photonMapSize);
+    CurrentSampler().StartPixel(randomSeed, 0);
     
     int photonFromLight = 0;
+    int photonIndex = 0;
     
     while (pMap.NumPhotons() < photonMapSize) {
+        CurrentSampler().StartSample(photonIndex++);
+        
         // TODO: Randomly decide on light source
         PointLight* currentLight = (PointLight*)lights[0];
         Color photonIntensity = currentLight->GetPhotonIntensity();
@@ -354,7 +606,7 @@ void GeneratePhotonMap()
         HitInfo photonH = HitInfo();
         
         // Trace the first hit
-        if (Trace(photonRay, &rootNode, photonH)) {
+        if (Trace(photonRay, photonH)) {
             photonFromLight++;
             
             if (photonH.node->GetMaterial()->IsPhotonSurface()) {
@@ -398,18 +650,20 @@ Color PhotonMapping(const Ray &r, const HitInfo &hInfo)
 {
     Color irradianceEst = Color(0.0, 0.0 ,0.0);
     Point3 irradianceDirection = Point3(0.0,0.0,0.0);
-    LightList dummyLL;
+    
+    //One photon light per thread, reused for every estimate
+    static thread_local LightList photonLightList;
+    if (photonLightList.empty()) {
+        photonLightList.push_back(new PhotonLight());
+    }
+    PhotonLight* d = (PhotonLight*)photonLightList[0];
 
     pMap.EstimateIrradiance<photonSampleSize>(irradianceEst, irradianceDirection, photonEstRadius, hInfo.p, &hInfo.N, photonEllipticity);
     
-    PhotonLight* d = new PhotonLight();
-    
     d->SetIntensity(irradianceEst);
     d->SetDirection(irradianceDirection);
-
-    dummyLL.push_back(d);
     
-    return hInfo.node->GetMaterial()->Shade(r, hInfo, dummyLL, 0);
+    return hInfo.node->GetMaterial()->Shade(r, hInfo, photonLightList, 0);
 }
 
 //Monte Carlo + Photon Mapping
@@ -426,13 +680,13 @@ Color MonteCarloPhoton(const HitInfo &hInfo, int x, int y, int numOfSamples)
         for (int b = 0; b < monteCarloBounces; b++) {
             // Create sample ray
             //            Point3 sampleOffset = SampleHemiSphere(hInfo.p, hInfo.N, 1.0);
-            Point3 sampleOffset = SampleHemiSphereCosine(hInfo.p, hInfo.N, 1.0);
+            Point3 sampleOffset = ToWorld(SampleCosineHemisphere(NextSample2D()), hInfo.N);
             Ray sampleRay = Ray(hInfo.p, sampleOffset.GetNormalized());
             
             actualBounces++;
             
             // Trace & Shade
-            if (Trace(sampleRay, &rootNode, h)) {
+            if (Trace(sampleRay, h)) {
                 // Sample Photonmap
                 c += PhotonMapping(sampleRay, h);
             }
@@ -450,150 +704,176 @@ Color MonteCarloPhoton(const HitInfo &hInfo, int x, int y, int numOfSamples)
     return c;
 }
 
-//Monte Carlo Sampling
-void MonteCarlo(LightList &copiedList, const HitInfo &hInfo, int x, int y, int bounces, int numOfSamples)
+//Path Tracing
+//Follows a single path from the camera hit, the light of the path is weighted by its throughput
+//At each hit, the direct light of every light is added (next event estimation), then the path continues
+//with one of the Monte Carlo bounce, reflection and refraction rays, picked by the weight of the rays
+//Russian roulette ends paths with a throughput below russianRouletteThreshold after russianRouletteDepth bounces
+//The direct light at hInfo is hitDirectLight, found by the caller with the shadow rays of other paths
+Color PathTrace(const Ray &r, const HitInfo &hInfo, int bounces, const Color &hitDirectLight)
 {
-//    Color cSum = Color(0.0, 0.0, 0.0);
-//
-//    for (int index = 0; index < numOfSamples; index++) {
-//        LightList currentSampleList;
-//
-////        AmbientLight* a = new AmbientLight();
-////        a->SetIntensity(Color(0.1,0.1,0.1));
-////
-////        currentSampleList.push_back(a);
-//
-////        Consider a stack implementation
-//        std::array<HitInfo, monteCarloBounces> hInfoBounceArray;
-//        std::array<Color, monteCarloBounces+1> directLightArray;
-//
-//        int actualBounces = 0;
-//
-//        // Forward Bounces
-//        for (int b = 0; b < monteCarloBounces; b++) {
-//            Color c = Color(0.0, 0.0, 0.0);
-//            hInfoBounceArray[b] = HitInfo();
-//            actualBounces++;
-//
-//            // Create sample ray
-//            //            Point3 sampleOffset = SampleHemiSphere(hInfo.p, hInfo.N, 1.0);
-//            Point3 sampleOffset = SampleHemiSphereCosine(hInfo.p, hInfo.N, 1.0);
-//            Ray sampleRay = Ray(hInfo.p, sampleOffset.GetNormalized());
-//
-//            // Trace & Shade
-//            if (Trace(sampleRay, &rootNode, hInfoBounceArray[b])) {
-//
-//                const Material* currentMaterial = hInfoBounceArray[b].node->GetMaterial();
-//
-//                c += currentMaterial->Shade(sampleRay, hInfoBounceArray[b], lights, 5);
-//
-//                // Store direct light
-//                directLightArray[b] = c;
-//
-////                c += h.node->GetMaterial()->Shade(sampleRay, h, currentSampleList, 5);
-//
-////                AmbientLight* a = new AmbientLight();
-////                a->SetIntensity(c);
-////
-////                currentSampleList.push_back(a);
-//            }
-//            else {
-//                c += background.Sample(Point3((float)x/camera.imgWidth, (float)y/camera.imgHeight, 0));
-//
-//                directLightArray[b] = c;
-//
-////                AmbientLight* a = new AmbientLight();
-////                a->SetIntensity(c);
-////
-////                currentSampleList.push_back(a);
-//                break;
-//            }
-//        }
-//
-//        // Add constant ambient light
-//        directLightArray[actualBounces] = Color(0.1,0.1,0.1);
-//
-//        // Backward loop calculating indirect light
-//        for (int i = actualBounces-1; i >= 0; i--) {
-//            // Get the previous light
-//            Color prevI = directLightArray[i+1];
-//
-//            // Create Ambient Light Source
-//            LightList dummy;
-//            AmbientLight* a = new AmbientLight();
-//            a->SetIntensity(prevI);
-//            dummy.push_back(a);
-//
-//            if (hInfoBounceArray[i].node) {
-//                directLightArray[i] += hInfoBounceArray[i].node->GetMaterial()->Shade(Ray(), hInfoBounceArray[i], dummy, 5);
-//            }
-//            else {
-//                directLightArray[i] += prevI;
-//            }
-//        }
-//
-//        AmbientLight* a = new AmbientLight();
-//        a->SetIntensity(directLightArray[0]);
-//        currentSampleList.push_back(a);
-//
-//        cSum += hInfo.node->GetMaterial()->Shade(r, hInfo, currentSampleList, 5);
-//    }
-//
-//    cSum /= (float)numOfSamples;
-//
-//    AmbientLight* a = new AmbientLight();
-//    a->SetIntensity(cSum);
-//
-//    copiedList.push_back(a);
+    Color result = Color(0.0, 0.0, 0.0);
+    Color throughput = Color(1.0, 1.0, 1.0);
+    Ray ray = r;
+    HitInfo h = hInfo;
     
-    Color c = Color(0.0, 0.0, 0.0);
+    //Bounces left, reflection and refraction paths get no Monte Carlo bounce, same as Shade()
+    int diffuseBounces = bounces;
+    int specularBounces = specularBounceCount;
     
-    if (bounces > 0)
-    {
-        // Sample a hemisphere on the hitpoint
-        for (int index = 0; index < numOfSamples; index++) {
-            // Data Structures
-            HitInfo h = HitInfo();
-            LightList currentSampleList;
-
-            // Create sample ray
-            //            Point3 sampleOffset = SampleHemiSphere(hInfo.p, hInfo.N, 1.0);
-            Point3 sampleOffset = SampleHemiSphereCosine(hInfo.p, hInfo.N, 1.0);
-            Ray sampleRay = Ray(hInfo.p, sampleOffset.GetNormalized());
-
-            // Trace & Shade
-            if (Trace(sampleRay, &rootNode, h)) {
-                const Material* currentMaterial = h.node->GetMaterial();
-
-                MonteCarlo(currentSampleList, h, x, y, bounces-1, 1);
-                c += currentMaterial->Shade(sampleRay, h, currentSampleList, 5);
-                c += currentMaterial->Shade(sampleRay, h, lights, 5);
+    for (int depth = 0; ; depth++) {
+        const Material* currentMaterial = h.node->GetMaterial();
+        
+        if (!RussianRoulette(depth, throughput)) {
+            break;
+        }
+        
+        //Next Event Estimation
+        if (depth == 0) {
+            result += throughput * hitDirectLight;
+        }
+        else {
+            for (size_t i = 0; i < lights.size(); i++) {
+                result += throughput * currentMaterial->ShadeLight(h, lights[i], lights[i]->Illuminate(h.p, h.N));
             }
-            else {
-//                c += background.Sample(Point3((float)x/camera.imgWidth, (float)y/camera.imgHeight, 0));
+        }
         
-                c += environment.SampleEnvironment(sampleRay.dir);
-                
-//                c += Color(0.1,0.1,0.1);
+        //The rays the path can continue with, the Monte Carlo bounce is the first one
+        SecondaryRay nextRays[Material::MAX_SECONDARY_RAYS + 1];
+        int numOfRays = 0;
+        
+        Color indirectWeight = currentMaterial->GetIndirectWeight(h);
+        if (indirectWeight != Color(0.0, 0.0, 0.0)) {
+            if (diffuseBounces > 0) {
+                SecondaryRay& indirect = nextRays[numOfRays++];
+                indirect.ray = Ray(h.p, ToWorld(SampleCosineHemisphere(NextSample2D()), h.N).GetNormalized());
+                indirect.hitWeight = indirectWeight;
+                indirect.missWeight = indirectWeight;
+                indirect.absorption = Color(0.0, 0.0, 0.0);
             }
+            else if (diffuseBounces == 0) {
+                result += throughput * indirectWeight * lastBounceIrradiance;
+            }
+        }
+        int numOfIndirectRays = numOfRays;
+        
+        //Reflection & Refraction
+        if (specularBounces > 0) {
+            numOfRays += currentMaterial->GetSecondaryRays(ray, h, nextRays + numOfRays);
+        }
+        
+        //Pick the ray the path continues with
+        Color hitThroughput, missThroughput;
+        int next = ChoosePathRay(nextRays, numOfRays, throughput, hitThroughput, missThroughput);
+        
+        if (next < 0) {
+            break;
+        }
+        
+        // Trace
+        ray = nextRays[next].ray;
+        HitInfo nextHit;
+        
+        if (!Trace(ray, nextHit)) {
+            result += missThroughput * environment.SampleEnvironment(ray.dir);
+            break;
+        }
+        
+        throughput = hitThroughput;
+        
+        //Absorption inside a refractive object
+        if (!nextHit.front && nextRays[next].absorption != Color(0.0, 0.0, 0.0)) {
+            throughput *= Color(exp((-nextHit.z)*nextRays[next].absorption.r),
+                                exp((-nextHit.z)*nextRays[next].absorption.g),
+                                exp((-nextHit.z)*nextRays[next].absorption.b));
+        }
+        
+        if (next < numOfIndirectRays) {
+            diffuseBounces--;
+            specularBounces = specularBounceCount;
         }
+        else {
+            diffuseBounces = -1;
+            specularBounces--;
+        }
+        
+        h = nextHit;
+    }
+    
+    return result;
+}
+
+//Largest of the r, g and b values
+static float MaxComponent(const Color& c)
+{
+    float m = (c.r > c.g) ? c.r : c.g;
+    return (m > c.b) ? m : c.b;
+}
 
-        c /= (float)monteCarloSampleSize;
+//Picks one of the rays a hit can continue its path with, with a probability proportional to its weight
+//Returns the ray and the throughput of its hit and miss, or -1 if none of the rays carries any light
+int ChoosePathRay(const SecondaryRay* rays, int numOfRays, const Color& throughput, Color& hitThroughput, Color& missThroughput)
+{
+    float rayWeights[Material::MAX_SECONDARY_RAYS + 1];
+    float weightSum = 0;
+    for (int i = 0; i < numOfRays; i++) {
+        float hitGray = rays[i].hitWeight.Gray();
+        float missGray = rays[i].missWeight.Gray();
+        rayWeights[i] = (hitGray > missGray) ? hitGray : missGray;
+        weightSum += rayWeights[i];
+    }
+    
+    //The path ends when none of the rays carries any light
+    if (weightSum <= 0) {
+        return -1;
     }
-    else {
-        c = Color(0.1, 0.1, 0.1);
+    
+    float pick = CurrentSampler().Get1D() * weightSum;
+    int next = 0;
+    while (next < numOfRays - 1 && (pick >= rayWeights[next] || rayWeights[next] <= 0)) {
+        pick -= rayWeights[next];
+        next++;
     }
+    
+    //Rounding may step past the last ray with a weight
+    while (rayWeights[next] <= 0) {
+        next--;
+    }
+    
+    float probability = rayWeights[next] / weightSum;
+    hitThroughput = throughput * rays[next].hitWeight / probability;
+    missThroughput = throughput * rays[next].missWeight / probability;
+    
+    return next;
+}
 
-    AmbientLight* a = new AmbientLight();
-    a->SetIntensity(c);
-
-    copiedList.push_back(a);
+//Russian Roulette at a hit of the path, once it is russianRouletteDepth bounces deep
+//The throughput includes the absorption up to the hit, the surviving paths make up for the ended ones
+//Ending paths with a high throughput adds more noise than it saves, so they always survive
+//Returns false if the path ends
+bool RussianRoulette(int depth, Color& throughput)
+{
+    if (depth < russianRouletteDepth) {
+        return true;
+    }
+    
+    float survival = MaxComponent(throughput) / russianRouletteThreshold;
+    
+    if (survival < 1.0f) {
+        if (CurrentSampler().Get1D() >= survival) {
+            return false;
+        }
+        
+        throughput /= survival;
+    }
+    
+    return true;
 }
 
 Ray CalculateReflectedRay(const Ray incomingRay, const HitInfo &hInfo, const float reflectionGlossiness) {
     // Glossiness Sampling
     Point3 sampleOrigin = hInfo.p+hInfo.N;
-    Point3 sampledOffset = SampleSphere(sampleOrigin, reflectionGlossiness);
+    Point3 sampledOffset = SampleUniformBall(NextSample3D()) * reflectionGlossiness;
     Point3 sampledNormal = (sampleOrigin + sampledOffset - hInfo.p).GetNormalized();
     
     //Calculate the reflected ray direction
@@ -607,7 +887,7 @@ Ray CalculateReflectedRay(const Ray incomingRay, const HitInfo &hInfo, const flo
 Ray CalculateRefractedRay(const Ray incomingRay, const HitInfo &hInfo, const float refractionGlossiness, const float ior) {
     //Calculate the reflected ray direction
     Point3 sampleOrigin = hInfo.p-hInfo.N;
-    Point3 sampledOffset = SampleSphere(sampleOrigin, refractionGlossiness);
+    Point3 sampledOffset = SampleUniformBall(NextSample3D()) * refractionGlossiness;
     Point3 sampledNormal = (sampleOrigin + sampledOffset - hInfo.p).GetNormalized();
     
     //Calcluate the refracted ray direction
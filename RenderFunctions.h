@@ -9,8 +9,14 @@
 #ifndef _RENDERFUNC_H_INCLUDED_
 #define _RENDERFUNC_H_INCLUDED_
 
-bool Trace(const Ray &r, Node* currentNode, HitInfo &hInfo);
-bool ShadowTrace(const Ray& r, Node* currentNode, HitInfo& hInfo);
-Point3 SampleSphere(Point3 origin, float radius);
+bool Trace(const Ray &r, HitInfo &hInfo);
+bool TraceHit(const Ray& r, HitRecord& hit);
+void GetHitInfo(const Ray& r, const HitRecord& hit, HitInfo& hInfo);
+bool ShadowTrace(const Ray& r, float t_max);
+void TracePacket(const Ray* rays, HitRecord* hits, bool* hitResult, int n);
+void ShadowTracePacket(const Ray* rays, const float* t_max, bool* occluded, int n);
+int ChoosePathRay(const SecondaryRay* rays, int numOfRays, const Color& throughput, Color& hitThroughput, Color& missThroughput);
+bool RussianRoulette(int depth, Color& throughput);
+void StorePixel(int x, int y, Color pixelValuesSum, int sampleCount);
 
 #endif
@@ -0,0 +1,139 @@
+//
+//  RenderThreadPool.h
+//  RayTracerXcode
+//
+
+#ifndef RenderThreadPool_h
+#define RenderThreadPool_h
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+
+//Fixed set of worker threads that all run the same job, e.g. Render(TileIterator&)
+//The workers sleep between jobs, so many frames can be rendered without re-spawning threads
+class RenderThreadPool
+{
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable jobCV;      //Signals the workers that a new job or shutdown is ready
+    std::condition_variable doneCV;     //Signals Wait() that the last worker has finished
+    std::function<void()> currentJob;
+    std::function<void()> cancelJob;    //Tells the current job to return early
+    unsigned int generation = 0;        //Incremented for every job
+    int activeWorkers = 0;
+    int numThreads = 0;
+    bool shutdown = false;
+
+public:
+    //0 threads uses one worker per hardware thread
+    RenderThreadPool(int threads = 0) { SetNumThreads(threads); }
+    ~RenderThreadPool()
+    {
+        Cancel();
+        StopWorkers();
+    }
+
+    int GetNumThreads() const { return numThreads; }
+
+    //Waits for the current job, the workers are spawned again on the next Run()
+    void SetNumThreads(int threads)
+    {
+        StopWorkers();
+
+        if (threads <= 0) {
+            threads = std::thread::hardware_concurrency();
+        }
+        numThreads = (threads > 0) ? threads : 1;
+    }
+
+    //Starts the job on every worker and returns immediately
+    //If a previous job is still running, waits for it first
+    //cancel is called by Cancel() while the job is running
+    void Run(const std::function<void()>& job, const std::function<void()>& cancel = nullptr)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        doneCV.wait(lock, [this] { return activeWorkers == 0; });
+
+        if (workers.empty()) {
+            shutdown = false;
+            for (int i = 0; i < numThreads; i++) {
+                workers.push_back(std::thread(&RenderThreadPool::WorkerLoop, this, generation));
+            }
+        }
+
+        currentJob = job;
+        cancelJob = cancel;
+        activeWorkers = (int)workers.size();
+        generation++;
+
+        lock.unlock();
+        jobCV.notify_all();
+    }
+
+    //Blocks until every worker has returned from the current job
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        doneCV.wait(lock, [this] { return activeWorkers == 0; });
+    }
+
+    //Asks the running job to stop, use Wait() to block until the workers have returned
+    void Cancel()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (activeWorkers > 0 && cancelJob) {
+            cancelJob();
+        }
+    }
+
+    bool IsBusy()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return activeWorkers > 0;
+    }
+
+private:
+    void WorkerLoop(unsigned int lastGeneration)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true) {
+            jobCV.wait(lock, [this, lastGeneration] { return shutdown || generation != lastGeneration; });
+
+            if (shutdown) {
+                return;
+            }
+
+            lastGeneration = generation;
+            std::function<void()> job = currentJob;
+
+            lock.unlock();
+            job();
+            lock.lock();
+
+            if (--activeWorkers == 0) {
+                doneCV.notify_all();
+            }
+        }
+    }
+
+    void StopWorkers()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        doneCV.wait(lock, [this] { return activeWorkers == 0; });
+        shutdown = true;
+        lock.unlock();
+        jobCV.notify_all();
+
+        for (std::thread& t : workers) {
+            t.join();
+        }
+        workers.clear();
+    }
+};
+
+#endif /* RenderThreadPool_h */
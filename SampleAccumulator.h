@@ -0,0 +1,45 @@
+//
+//  SampleAccumulator.h
+//  RayTracerXcode
+//
+
+#ifndef SampleAccumulator_h
+#define SampleAccumulator_h
+
+#include "ExternalLibrary/scene.h"
+#include <math.h>
+
+//Streams the samples of a pixel into a running sum and luminance variance (Welford),
+//so a pixel needs the same small amount of memory for any number of samples
+struct SampleAccumulator
+{
+    Color sum = Color(0.0, 0.0, 0.0);
+    float luminanceMean = 0.0;
+    float luminanceM2 = 0.0;
+    int count = 0;
+
+    void Add(const Color &c)
+    {
+        sum += c;
+        count++;
+
+        //Luminance is measured after gamma correction, so that dark regions are not accepted too early
+        float luminance = pow(fmaxf(c.Gray(), 0.0f), 1/2.2);
+        float delta = luminance - luminanceMean;
+        luminanceMean += delta / (float)count;
+        luminanceM2 += delta * (luminance - luminanceMean);
+    }
+
+    //Variance of the pixel estimate, the sample variance divided by the number of samples
+    float VarianceOfMean() const
+    {
+        if (count < 2) {
+            return BIGFLOAT;
+        }
+        return luminanceM2 / (float)(count - 1) / (float)count;
+    }
+
+    Color Mean() const { return sum / (float)count; }
+};
+
+#endif /* SampleAccumulator_h */
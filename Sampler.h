@@ -0,0 +1,155 @@
+//
+//  Sampler.h
+//  RayTracerXcode
+//
+
+#ifndef Sampler_h
+#define Sampler_h
+
+#include "ExternalLibrary/scene.h"
+#include <stdint.h>
+
+//Low discrepancy sampler, Owen scrambled 2D Sobol points padded over the dimensions
+//A sample value is indexed by (pixel, sample, dimension) and costs four table lookups and a few hashes
+//
+//Usage: StartPixel() once per pixel, StartSample() once per sample,
+//then each Get1D()/Get2D() call takes the next dimension of the sample
+//Every dimension shuffles the sample indices and scrambles the points with its own seed
+//(Burley, "Practical Hash-based Owen Scrambling"), so the dimensions are not correlated
+class Sampler
+{
+private:
+    uint32_t pixelSeed = 0;
+    uint32_t sampleIndex = 0;
+    uint32_t dimension = 0;
+
+    //Generator matrices of the first two Sobol dimensions, one 256 entry table per byte of the index
+    struct SobolTables
+    {
+        uint32_t m[2][4][256];
+
+        SobolTables()
+        {
+            uint32_t v[2][32];
+            for (int i = 0; i < 32; i++) {
+                v[0][i] = 1U << (31 - i);
+                v[1][i] = (i == 0) ? (1U << 31) : (v[1][i-1] ^ (v[1][i-1] >> 1));
+            }
+
+            for (int d = 0; d < 2; d++) {
+                for (int byte = 0; byte < 4; byte++) {
+                    for (int b = 0; b < 256; b++) {
+                        uint32_t x = 0;
+                        for (int bit = 0; bit < 8; bit++) {
+                            if (b & (1 << bit)) {
+                                x ^= v[d][byte * 8 + bit];
+                            }
+                        }
+                        m[d][byte][b] = x;
+                    }
+                }
+            }
+        }
+    };
+
+public:
+    //Restarts the sample sequence for a pixel, or any other stream of samples
+    void StartPixel(uint32_t seed, uint32_t pixel)
+    {
+        pixelSeed = Hash(seed ^ Hash(pixel));
+        sampleIndex = 0;
+        dimension = 0;
+    }
+
+    //Starts a sample at the given dimension, 0 for the first value of the sample
+    void StartSample(uint32_t index, uint32_t startDimension = 0)
+    {
+        sampleIndex = index;
+        dimension = startDimension;
+    }
+
+    uint32_t GetDimension() const { return dimension; }
+
+    float Get1D()
+    {
+        uint32_t seed = DimensionSeed(dimension++);
+        uint32_t i = NestedUniformScramble(sampleIndex, seed);
+
+        return ToFloat(NestedUniformScramble(Sobol(i, 0), Hash(seed + 1)));
+    }
+
+    Point2 Get2D()
+    {
+        uint32_t seed = DimensionSeed(dimension++);
+        uint32_t i = NestedUniformScramble(sampleIndex, seed);
+
+        return Point2(ToFloat(NestedUniformScramble(Sobol(i, 0), Hash(seed + 1))),
+                      ToFloat(NestedUniformScramble(Sobol(i, 1), Hash(seed + 2))));
+    }
+
+private:
+    //32 bit integer hash with good avalanche (triple32 by Chris Wellons)
+    static uint32_t Hash(uint32_t x)
+    {
+        x ^= x >> 17;
+        x *= 0xed5ad4bbU;
+        x ^= x >> 11;
+        x *= 0xac4c1b51U;
+        x ^= x >> 15;
+        x *= 0x31848babU;
+        x ^= x >> 14;
+        return x;
+    }
+
+    //Uses the upper 24 bits, so the result is never rounded up to 1
+    static float ToFloat(uint32_t x) { return (float)(x >> 8) * (1.0f / 16777216.0f); }
+
+    uint32_t DimensionSeed(uint32_t d) const { return Hash(pixelSeed ^ Hash(d)); }
+
+    static const SobolTables& Tables()
+    {
+        static const SobolTables tables;
+        return tables;
+    }
+
+    static uint32_t Sobol(uint32_t index, int d)
+    {
+        const SobolTables& t = Tables();
+        return t.m[d][0][index & 255] ^ t.m[d][1][(index >> 8) & 255] ^
+               t.m[d][2][(index >> 16) & 255] ^ t.m[d][3][index >> 24];
+    }
+
+    static uint32_t ReverseBits(uint32_t x)
+    {
+        x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+        x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+        x = ((x >> 4) & 0x0F0F0F0FU) | ((x & 0x0F0F0F0FU) << 4);
+        x = ((x >> 8) & 0x00FF00FFU) | ((x & 0x00FF00FFU) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    //Each bit is flipped based on the bits below it, a hash based Owen scramble of a reversed value
+    static uint32_t LaineKarrasPermutation(uint32_t x, uint32_t seed)
+    {
+        x ^= x * 0x3d20adeaU;
+        x += seed;
+        x *= (seed >> 16) | 1;
+        x ^= x * 0x05526c56U;
+        x ^= x * 0x53a22864U;
+        return x;
+    }
+
+    static uint32_t NestedUniformScramble(uint32_t x, uint32_t seed)
+    {
+        return ReverseBits(LaineKarrasPermutation(ReverseBits(x), seed));
+    }
+};
+
+//Sampler of the calling thread
+inline Sampler& CurrentSampler()
+{
+    static thread_local Sampler sampler;
+    return sampler;
+}
+
+#endif /* Sampler_h */
@@ -0,0 +1,108 @@
+//
+//  Sampling.h
+//  RayTracerXcode
+//
+
+#ifndef Sampling_h
+#define Sampling_h
+
+#include "ExternalLibrary/scene.h"
+#include "Sampler.h"
+#include <math.h>
+
+//Closed form mappings from uniform samples in [0,1)^2 to the sampled domain
+//Every sample maps to exactly one point, there is no rejection loop
+
+//Uniform point on the unit disk, concentric mapping of Shirley and Chiu
+inline Point2 SampleConcentricDisk(const Point2 &u)
+{
+    float a = 2*u.x - 1;
+    float b = 2*u.y - 1;
+
+    if (a == 0 && b == 0) {
+        return Point2(0, 0);
+    }
+
+    float r, phi;
+    if (a*a > b*b) {
+        r = a;
+        phi = (M_PI/4) * (b/a);
+    }
+    else {
+        r = b;
+        phi = (M_PI/2) - (M_PI/4) * (a/b);
+    }
+
+    return Point2(r * cosf(phi), r * sinf(phi));
+}
+
+//Uniform direction on the unit sphere
+inline Point3 SampleUniformSphere(const Point2 &u)
+{
+    float z = 1 - 2*u.x;
+    float r = sqrtf(fmaxf(0.0f, 1 - z*z));
+    float phi = 2 * M_PI * u.y;
+
+    return Point3(r * cosf(phi), r * sinf(phi), z);
+}
+
+//Uniform point inside the unit ball, the radius is the cube root of the third sample
+inline Point3 SampleUniformBall(const Point3 &u)
+{
+    return SampleUniformSphere(Point2(u.x, u.y)) * cbrtf(u.z);
+}
+
+//Uniform direction on the hemisphere around +z
+inline Point3 SampleUniformHemisphere(const Point2 &u)
+{
+    float z = u.x;
+    float r = sqrtf(fmaxf(0.0f, 1 - z*z));
+    float phi = 2 * M_PI * u.y;
+
+    return Point3(r * cosf(phi), r * sinf(phi), z);
+}
+
+//Cosine weighted direction on the hemisphere around +z, a disk sample projected up onto the hemisphere
+inline Point3 SampleCosineHemisphere(const Point2 &u)
+{
+    Point2 d = SampleConcentricDisk(u);
+    float z = sqrtf(fmaxf(0.0f, 1 - d.x*d.x - d.y*d.y));
+
+    return Point3(d.x, d.y, z);
+}
+
+//Builds two tangents that form an orthonormal basis with the unit vector n
+//Branchless method of Duff et al., "Building an Orthonormal Basis, Revisited"
+inline void OrthonormalBasis(const Point3 &n, Point3 &t, Point3 &b)
+{
+    float sign = copysignf(1.0f, n.z);
+    float a = -1.0f / (sign + n.z);
+    float c = n.x * n.y * a;
+
+    t = Point3(1.0f + sign * n.x * n.x * a, sign * c, -sign * n.x);
+    b = Point3(c, sign + n.y * n.y * a, -n.y);
+}
+
+//Rotates a direction sampled around +z to the hemisphere around the unit vector n
+inline Point3 ToWorld(const Point3 &local, const Point3 &n)
+{
+    Point3 t, b;
+    OrthonormalBasis(n, t, b);
+
+    return t * local.x + b * local.y + n * local.z;
+}
+
+//Next dimensions of the current sample of the calling thread
+inline Point2 NextSample2D()
+{
+    return CurrentSampler().Get2D();
+}
+
+inline Point3 NextSample3D()
+{
+    Point2 xy = CurrentSampler().Get2D();
+    float z = CurrentSampler().Get1D();
+    return Point3(xy.x, xy.y, z);
+}
+
+#endif /* Sampling_h */
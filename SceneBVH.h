@@ -0,0 +1,137 @@
+//
+//  SceneBVH.h
+//  RayTracerXcode
+//
+
+#ifndef SceneBVH_h
+#define SceneBVH_h
+
+#include "ExternalLibrary/scene.h"
+#include "ExternalLibrary/objects.h"
+#include <vector>
+
+//An object node of the scene graph with its accumulated world transformation
+struct SceneInstance
+{
+    const Node* node;
+    const Object* obj;
+    Transformation transform;   //Object space to world space
+    Box worldBox;               //Bounding box of the object in world space
+
+    //Same as Node::FromNodeCoords, but goes straight from object space to world space
+    //Only called for the closest hit of a ray, once the traversal is done
+    void FromObjectCoords(HitInfo &hInfo) const
+    {
+        hInfo.p = transform.TransformFrom(hInfo.p);
+        hInfo.N = (transform.GetNormalTransform() * hInfo.N).GetNormalized();
+    }
+};
+
+//The part of an instance that the traversal reads for every instance it visits, kept in its own array
+//The world to object transformation is precomposed into a single matrix and offset
+struct SceneInstanceTransform
+{
+    Matrix3 toObject;
+    Point3 toObjectOffset;
+    const Object* obj;
+
+    //Same as Node::ToNodeCoords, but goes straight from world space to object space
+    Ray ToObjectCoords(const Ray &ray) const
+    {
+        Ray r;
+        r.p   = toObject * ray.p + toObjectOffset;
+        r.dir = toObject * ray.dir;
+        r.UpdateInverse();
+        return r;
+    }
+};
+
+//Top level BVH over all object instances of the scene graph
+//The bottom level is the BVH of each object (cyBVHTriMesh for TriObj)
+class SceneBVH : public cyBVH
+{
+public:
+    //Flattens the scene graph into a list of instances and builds the hierarchy
+    //Must be called after LoadScene()
+    void SetScene(const ::Node* root)
+    {
+        instances.clear();
+        CollectInstances(root, Transformation());
+        Build((unsigned int)instances.size(), 4);
+        CompileInstances();
+    }
+
+    unsigned int GetNumInstances() const { return (unsigned int)instances.size(); }
+    const SceneInstance& GetInstance(unsigned int i) const { return instances[i]; }
+    const SceneInstanceTransform& GetInstanceTransform(unsigned int i) const { return instanceTransforms[i]; }
+
+    //The instances are stored in the order of the leaves, the instances of a leaf start at this index
+    unsigned int GetNodeFirstInstance(unsigned int nodeID) const { return GetNodeElementOffset(nodeID); }
+
+protected:
+    virtual void GetElementBounds(unsigned int i, float box[6]) const
+    {
+        const ::Box& b = instances[i].worldBox;
+        box[0] = b.pmin.x; box[1] = b.pmin.y; box[2] = b.pmin.z;
+        box[3] = b.pmax.x; box[4] = b.pmax.y; box[5] = b.pmax.z;
+    }
+
+    virtual float GetElementCenter(unsigned int i, int dimension) const
+    {
+        const ::Box& b = instances[i].worldBox;
+        return 0.5f * (b.pmin[dimension] + b.pmax[dimension]);
+    }
+
+private:
+    std::vector<SceneInstance> instances;
+    std::vector<SceneInstanceTransform> instanceTransforms;
+
+    //Sorts the instances into the element order of the hierarchy, then fills the transform array
+    //After this the element indices of the leaves are no longer needed by the traversal
+    void CompileInstances()
+    {
+        std::vector<SceneInstance> sorted;
+        sorted.reserve(instances.size());
+        for (unsigned int i = 0; i < instances.size(); i++) {
+            sorted.push_back(instances[GetElements()[i]]);
+        }
+        instances.swap(sorted);
+
+        instanceTransforms.resize(instances.size());
+        for (unsigned int i = 0; i < instances.size(); i++) {
+            const Transformation& transform = instances[i].transform;
+            instanceTransforms[i].toObject = transform.GetInverseTransform();
+            instanceTransforms[i].toObjectOffset = -(transform.GetInverseTransform() * transform.GetPosition());
+            instanceTransforms[i].obj = instances[i].obj;
+        }
+    }
+
+    //Recursively accumulates node transformations down the hierarchy
+    void CollectInstances(const ::Node* node, const Transformation& parentTransform)
+    {
+        //Apply the parent transformation on top of the node transformation
+        //The composite matrix, its inverse and the normal matrix are computed once here
+        Transformation world = *node;
+        world.Transform(parentTransform);
+
+        if (node->GetNodeObj() != nullptr) {
+            SceneInstance instance;
+            instance.node = node;
+            instance.obj = node->GetNodeObj();
+            instance.transform = world;
+
+            ::Box objectBox = instance.obj->GetBoundBox();
+            for (int j = 0; j < 8; j++) {
+                instance.worldBox += world.TransformFrom(objectBox.Corner(j));
+            }
+
+            instances.push_back(instance);
+        }
+
+        for (int i = 0; i < node->GetNumChild(); i++) {
+            CollectInstances(node->GetChild(i), world);
+        }
+    }
+};
+
+#endif /* SceneBVH_h */
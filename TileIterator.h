@@ -0,0 +1,188 @@
+//
+//  TileIterator.h
+//  RayTracerXcode
+//
+
+#ifndef TileIterator_h
+#define TileIterator_h
+
+#include "ExternalLibrary/lodepng.h"
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+
+enum TileOrder
+{
+    TILE_ORDER_SCANLINE,
+    TILE_ORDER_MORTON,
+    TILE_ORDER_HILBERT
+};
+
+//Hands out square tiles of the image to the render threads
+//Each call to GetTile claims a whole tile, so the shared counter is touched once per tile
+class TileIterator
+{
+public:
+    struct Tile
+    {
+        int x0, y0;     //Top left pixel (inclusive)
+        int x1, y1;     //Bottom right pixel (exclusive)
+        int index;      //Index of the tile in the scanline order
+    };
+
+private:
+    std::atomic_int nextTile{0};
+    std::atomic_int finishedTiles{0};
+    std::atomic_bool cancelled{false};
+    int imageWidth, imageHeight;
+    int tileSize;
+    int tilesX, tilesY;
+    std::vector<int> tileOrder;     //Tile indices in the order they are handed out
+    std::vector<float> tileTime;    //Render time of each tile in seconds
+
+public:
+    TileIterator(int width, int height, int size = 16, TileOrder order = TILE_ORDER_MORTON)
+        : imageWidth(width), imageHeight(height), tileSize(size)
+    {
+        tilesX = (imageWidth + tileSize - 1) / tileSize;
+        tilesY = (imageHeight + tileSize - 1) / tileSize;
+
+        tileOrder.resize(tilesX * tilesY);
+        tileTime.assign(tilesX * tilesY, 0.0f);
+
+        //Sort the tiles along the space filling curve
+        std::vector<std::pair<unsigned int, int>> keys(tilesX * tilesY);
+        for (int i = 0; i < tilesX * tilesY; i++) {
+            keys[i] = std::make_pair(CurveIndex(i % tilesX, i / tilesX, order), i);
+        }
+        std::sort(keys.begin(), keys.end());
+
+        for (int i = 0; i < tilesX * tilesY; i++) {
+            tileOrder[i] = keys[i].second;
+        }
+    }
+    ~TileIterator() {}
+
+    int GetNumTiles() const { return tilesX * tilesY; }
+
+    bool GetTile(Tile& tile)
+    {
+        if (cancelled) {
+            return false;
+        }
+
+        int i = nextTile++;
+
+        if (i >= GetNumTiles()) {
+            return false;
+        }
+
+        int t = tileOrder[i];
+        tile.index = t;
+        tile.x0 = (t % tilesX) * tileSize;
+        tile.y0 = (t / tilesX) * tileSize;
+        tile.x1 = (tile.x0 + tileSize < imageWidth) ? tile.x0 + tileSize : imageWidth;
+        tile.y1 = (tile.y0 + tileSize < imageHeight) ? tile.y0 + tileSize : imageHeight;
+        return true;
+    }
+
+    //Called by the render thread once all pixels of the tile are written
+    void FinishTile(const Tile& tile, float seconds)
+    {
+        tileTime[tile.index] = seconds;
+        finishedTiles++;
+    }
+
+    bool IterationComplete() {
+        return finishedTiles >= GetNumTiles();
+    }
+
+    //No more tiles are handed out, tiles that are being rendered still finish
+    void Cancel() { cancelled = true; }
+    bool IsCancelled() const { return cancelled; }
+
+    float GetTileTime(int tileIndex) const { return tileTime[tileIndex]; }
+
+    //Prints the total render time of all tiles and the slowest tiles
+    void PrintTileTimes(int count = 5) const
+    {
+        std::vector<int> sorted(GetNumTiles());
+        float total = 0.0;
+        for (int i = 0; i < GetNumTiles(); i++) {
+            sorted[i] = i;
+            total += tileTime[i];
+        }
+        if (count > GetNumTiles()) {
+            count = GetNumTiles();
+        }
+        std::partial_sort(sorted.begin(), sorted.begin() + count, sorted.end(),
+                          [this](int a, int b) { return tileTime[a] > tileTime[b]; });
+
+        printf("Tile time: %.3f s in %i tiles of %ix%i\n", total, GetNumTiles(), tileSize, tileSize);
+        for (int i = 0; i < count; i++) {
+            int t = sorted[i];
+            printf("   tile (%i, %i): %.3f s\n", (t % tilesX) * tileSize, (t / tilesX) * tileSize, tileTime[t]);
+        }
+    }
+
+    //Saves the tile times as a grayscale heat map, brightest is the slowest tile
+    bool SaveTileTimeImage(const char* filename) const
+    {
+        float maxTime = *std::max_element(tileTime.begin(), tileTime.end());
+        std::vector<unsigned char> img(imageWidth * imageHeight, 0);
+
+        if (maxTime > 0) {
+            for (int y = 0; y < imageHeight; y++) {
+                for (int x = 0; x < imageWidth; x++) {
+                    float f = tileTime[(y / tileSize) * tilesX + x / tileSize] / maxTime;
+                    img[y * imageWidth + x] = (unsigned char)(f * 255);
+                }
+            }
+        }
+
+        return lodepng::encode(filename, img, imageWidth, imageHeight, LCT_GREY, 8) == 0;
+    }
+
+private:
+    //Position of the tile along the space filling curve
+    unsigned int CurveIndex(unsigned int x, unsigned int y, TileOrder order) const
+    {
+        switch (order) {
+            case TILE_ORDER_MORTON: {
+                unsigned int d = 0;
+                for (int b = 0; b < 16; b++) {
+                    d |= ((x >> b) & 1) << (2 * b);
+                    d |= ((y >> b) & 1) << (2 * b + 1);
+                }
+                return d;
+            }
+            case TILE_ORDER_HILBERT: {
+                unsigned int n = 1;
+                while (n < (unsigned int)tilesX || n < (unsigned int)tilesY) {
+                    n <<= 1;
+                }
+                unsigned int d = 0;
+                for (unsigned int s = n / 2; s > 0; s /= 2) {
+                    unsigned int rx = (x & s) > 0;
+                    unsigned int ry = (y & s) > 0;
+                    d += s * s * ((3 * rx) ^ ry);
+                    //Rotate the quadrant
+                    if (ry == 0) {
+                        if (rx == 1) {
+                            x = s - 1 - x;
+                            y = s - 1 - y;
+                        }
+                        std::swap(x, y);
+                    }
+                }
+                return d;
+            }
+            default:
+                return y * tilesX + x;
+        }
+    }
+};
+
+
+#endif /* TileIterator_h */
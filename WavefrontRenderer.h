@@ -0,0 +1,705 @@
+//
+//  WavefrontRenderer.h
+//  RayTracerXcode
+//
+
+#ifndef WavefrontRenderer_h
+#define WavefrontRenderer_h
+
+#include "ExternalLibrary/scene.h"
+#include "ExternalLibrary/lights.h"
+#include "RenderFunctions.h"
+#include "RenderThreadPool.h"
+#include "TileIterator.h"
+#include "SceneBVH.h"
+#include "CameraRayGenerator.h"
+#include "SampleAccumulator.h"
+#include "Sampling.h"
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include <math.h>
+
+//Scene of the frame, defined in main.cpp
+extern SceneBVH sceneBVH;
+extern Camera camera;
+extern CameraRayGenerator cameraRays;
+extern RenderImage renderImage;
+extern MaterialList materials;
+extern LightList lights;
+extern TexturedColor background;
+extern TexturedColor environment;
+
+//Renders the image in waves of tiles, the paths of a wave advance together one stage at a time:
+//  camera: generates the camera rays of all samples of the wave
+//  extend: traces the ray queue, rays are sorted by octant and origin so that neighbouring rays visit the same nodes
+//  shade:  hits are sorted by material, each hit queues its shadow rays and the one ray that continues its path
+//  shadow: traces the shadow ray queue, sorted like the extend queue
+//The paths are the same as the ones of PathTrace(), but the path state lives in the queues instead of in its loop,
+//and every stage is split into chunks that the thread pool balances, instead of whole pixels
+//
+//Each chunk writes its results to its own output, which are joined in chunk order,
+//so the image does not depend on the number of threads
+class WavefrontRenderer
+{
+public:
+    struct Settings
+    {
+        int minSamples = 8;
+        int maxSamples = 1024;
+        int sampleIncrement = 1;
+        float targetVariance = 0.0001;
+        int diffuseBounces = 4;                         //Monte Carlo bounces after a camera hit
+        int specularBounces = 5;                        //Reflection and refraction bounces of a hit
+        Color lastBounceIrradiance = Color(0.1, 0.1, 0.1);  //Indirect light of the last Monte Carlo bounce
+        unsigned int seed = 0;
+        unsigned int cameraSampleDimensions = 2;
+        int pixelsPerWave = 4096;
+        int chunkSize = 256;                            //Queue entries claimed at once by a render thread
+    };
+
+private:
+    enum RayType : unsigned char
+    {
+        RAY_CAMERA,
+        RAY_INDIRECT,
+        RAY_SECONDARY
+    };
+
+    //A ray of a path waiting in the extend queue, with everything needed to continue the path
+    struct PathRay
+    {
+        Ray ray;
+        Color weight;               //Weight of the light shaded at the hit point
+        Color missWeight;           //Weight of the background or environment if the ray leaves the scene
+        Color absorption;           //Absorbed along the ray if it hits a back face
+        unsigned int sample;        //Sample of the wave the path belongs to
+        unsigned int dimension;     //Next sampler dimension of the path
+        int depth;                  //Hits of the path before the hit of this ray
+        int diffuseBounces;         //Remaining Monte Carlo bounces, negative if the hit gets no indirect light
+        int specularBounces;        //Remaining reflection and refraction bounces
+        RayType type;
+        unsigned int key;
+    };
+
+    struct ShadowRay
+    {
+        Ray ray;
+        float t;                    //Distance to the light
+        Color contribution;         //Added to the sample if the light is not occluded
+        unsigned int sample;
+        unsigned int key;
+    };
+
+    struct Contribution
+    {
+        unsigned int sample;
+        Color color;
+    };
+
+    struct Pixel
+    {
+        int x, y;
+        int tile;                   //Tile of the wave the pixel belongs to
+        SampleAccumulator accumulator;
+        int firstSample;            //First sample of the pixel in the current pass
+        int numSamples;
+    };
+
+    struct Sample
+    {
+        unsigned int pixel;         //Pixel of the wave
+        unsigned int index;         //Sample index of the pixel
+        Color radiance;
+    };
+
+    //Results of one chunk of a stage
+    struct ChunkOutput
+    {
+        std::vector<PathRay> rays;
+        std::vector<ShadowRay> shadowRays;
+        std::vector<Contribution> contributions;
+
+        void Clear()
+        {
+            rays.clear();
+            shadowRays.clear();
+            contributions.clear();
+        }
+    };
+
+    //A claimed tile, finished once all of its pixels are stored
+    struct TileState
+    {
+        TileIterator::Tile tile;
+        int remainingPixels;
+        float time;                 //Share of the pass times, split by samples
+        int passSamples;
+    };
+
+    Settings settings;
+    RenderThreadPool* pool = nullptr;
+    std::atomic_bool cancelled{false};
+
+    //Slots of finished tiles and pixels are reused, so the lists only grow to the size of a wave
+    std::vector<TileState> tiles;
+    std::vector<Pixel> pixels;                  //Pixels of the claimed tiles that are not stored yet
+    std::vector<unsigned int> freeTiles;
+    std::vector<unsigned int> freePixels;
+    std::vector<unsigned int> activePixels;
+    std::vector<Sample> samples;
+
+    //The queues are not moved when they are sorted, the stages visit them in the order of an index list
+    std::vector<PathRay> rayQueue;
+    std::vector<HitRecord> rayHits;             //Hit of each ray of the extend queue, expanded to a HitInfo when it is shaded
+    std::vector<ShadowRay> shadowQueue;
+    std::vector<unsigned int> rayOrder;
+    std::vector<unsigned int> hitOrder;         //Rays of the extend queue that hit, sorted by material
+    std::vector<unsigned int> shadowOrder;
+    std::vector<ChunkOutput> chunkOutputs;
+    size_t numChunkOutputs = 0;                 //Chunks written by the last stage
+    std::vector<uint64_t> sortKeys;
+    std::vector<unsigned int> sortedOrder;
+
+    std::unordered_map<const Material*, unsigned int> materialKeys;
+    Point3 sceneMin, sceneScale;    //Maps the scene box to the grid of the origin keys
+
+public:
+    //Stops the frame after the current stage
+    void Cancel() { cancelled = true; }
+
+    //Renders all tiles of the iterator, the stages are run on the workers of the pool
+    //Adaptive sampling is done in passes, every pass adds a batch of samples to each active pixel, same as RenderPixel
+    //New tiles are claimed whenever converged pixels leave the wave, so the queues stay large until the end of the frame
+    void Render(TileIterator& tileIterator, RenderThreadPool& renderPool, const Settings& renderSettings)
+    {
+        settings = renderSettings;
+        pool = &renderPool;
+        cancelled = false;
+
+        PrepareScene();
+        tiles.clear();
+        pixels.clear();
+        freeTiles.clear();
+        freePixels.clear();
+        activePixels.clear();
+
+        while (!cancelled) {
+            ClaimTiles(tileIterator);
+
+            if (activePixels.empty()) {
+                break;
+            }
+
+            auto passStart = std::chrono::steady_clock::now();
+
+            GenerateCameraRays();
+
+            while (!rayQueue.empty() && !cancelled) {
+                ExtendRays();
+                ShadeHits();
+                TraceShadowRays();
+            }
+
+            if (cancelled) {
+                break;
+            }
+
+            std::chrono::duration<float> passTime = std::chrono::steady_clock::now() - passStart;
+            FinishPass(tileIterator, passTime.count());
+        }
+
+        if (cancelled) {
+            tileIterator.Cancel();
+        }
+    }
+
+private:
+    void PrepareScene()
+    {
+        //Hits are sorted by the index of their material
+        materialKeys.clear();
+        for (size_t i = 0; i < materials.size(); i++) {
+            materialKeys[materials[i]] = (unsigned int)i;
+        }
+
+        //Ray origins are quantized to a 512^3 grid over the scene box
+        sceneMin = Point3(0, 0, 0);
+        sceneScale = Point3(0, 0, 0);
+        if (sceneBVH.GetNumInstances() > 0) {
+            const float* bounds = sceneBVH.GetNodeBounds(sceneBVH.GetRootNodeID());
+            sceneMin = Point3(bounds[0], bounds[1], bounds[2]);
+            for (int i = 0; i < 3; i++) {
+                float size = bounds[i+3] - bounds[i];
+                sceneScale[i] = (size > 0) ? 512.0f / size : 0.0f;
+            }
+        }
+    }
+
+    //Claims tiles until the wave has enough active pixels, then lays out the samples of the next pass
+    void ClaimTiles(TileIterator& tileIterator)
+    {
+        TileIterator::Tile tile;
+        while ((int)activePixels.size() < settings.pixelsPerWave && tileIterator.GetTile(tile)) {
+            unsigned int t = AllocateSlot(tiles, freeTiles);
+            TileState state = {tile, (tile.x1 - tile.x0) * (tile.y1 - tile.y0), 0.0f, 0};
+            tiles[t] = state;
+
+            for (int y = tile.y0; y < tile.y1; y++) {
+                for (int x = tile.x0; x < tile.x1; x++) {
+                    unsigned int p = AllocateSlot(pixels, freePixels);
+                    Pixel& pixel = pixels[p];
+                    pixel.x = x;
+                    pixel.y = y;
+                    pixel.tile = (int)t;
+                    pixel.accumulator = SampleAccumulator();
+                    pixel.firstSample = 0;
+                    pixel.numSamples = 0;
+                    activePixels.push_back(p);
+                }
+            }
+        }
+
+        samples.clear();
+        for (unsigned int p : activePixels) {
+            Pixel& pixel = pixels[p];
+            int sampleCount = pixel.accumulator.count;
+            int batchSize = (sampleCount < settings.minSamples) ? settings.minSamples - sampleCount : settings.sampleIncrement;
+            if (batchSize > settings.maxSamples - sampleCount) {
+                batchSize = settings.maxSamples - sampleCount;
+            }
+
+            pixel.firstSample = (int)samples.size();
+            pixel.numSamples = batchSize;
+            for (int s = 0; s < batchSize; s++) {
+                Sample sample = {p, (unsigned int)(sampleCount + s), Color(0, 0, 0)};
+                samples.push_back(sample);
+            }
+            tiles[pixel.tile].passSamples += batchSize;
+        }
+    }
+
+    //Adds the samples of the pass to their pixels, and stores the pixels and tiles that are done
+    void FinishPass(TileIterator& tileIterator, float passTime)
+    {
+        //Tiles that share a pass share its time
+        for (TileState& tile : tiles) {
+            if (tile.passSamples > 0) {
+                tile.time += passTime * (float)tile.passSamples / (float)samples.size();
+                tile.passSamples = 0;
+            }
+        }
+
+        size_t numActive = 0;
+
+        for (unsigned int p : activePixels) {
+            Pixel& pixel = pixels[p];
+            for (int s = 0; s < pixel.numSamples; s++) {
+                pixel.accumulator.Add(samples[pixel.firstSample + s].radiance);
+            }
+
+            int sampleCount = pixel.accumulator.count;
+            bool converged = sampleCount >= settings.minSamples && pixel.accumulator.VarianceOfMean() < settings.targetVariance;
+
+            if (converged || sampleCount >= settings.maxSamples) {
+                StorePixel(pixel.x, pixel.y, pixel.accumulator.Mean(), sampleCount);
+
+                TileState& tile = tiles[pixel.tile];
+                if (--tile.remainingPixels == 0) {
+                    tileIterator.FinishTile(tile.tile, tile.time);
+                    freeTiles.push_back((unsigned int)pixel.tile);
+                }
+                freePixels.push_back(p);
+            }
+            else {
+                activePixels[numActive++] = p;
+            }
+        }
+
+        activePixels.resize(numActive);
+    }
+
+    //Camera Stage
+    void GenerateCameraRays()
+    {
+        rayQueue.resize(samples.size());
+
+        ParallelChunks(samples.size(), [this](size_t begin, size_t end, ChunkOutput&) {
+            Sampler& sampler = CurrentSampler();
+
+            for (size_t i = begin; i < end; i++) {
+                const Pixel& pixel = pixels[samples[i].pixel];
+                StartPathSample(sampler, samples[i], 0);
+
+                Point2 pixelOffset = sampler.Get2D();
+                Point2 lensSample = sampler.Get2D();
+
+                PathRay& path = rayQueue[i];
+                path.ray = cameraRays.GetRay(pixel.x, pixel.y, pixelOffset, lensSample);
+                path.weight = Color(1, 1, 1);
+                path.missWeight = Color(1, 1, 1);
+                path.absorption = Color(0, 0, 0);
+                path.sample = (unsigned int)i;
+                path.dimension = settings.cameraSampleDimensions;
+                path.depth = 0;
+                path.diffuseBounces = settings.diffuseBounces;
+                path.specularBounces = settings.specularBounces;
+                path.type = RAY_CAMERA;
+                path.key = RayKey(path.ray);
+            }
+        });
+    }
+
+    //Extend Stage
+    //The camera rays of a pixel are traced as packets, rays of different pixels or bounces are too incoherent
+    void ExtendRays()
+    {
+        SortByKey(rayQueue, rayOrder);
+        rayHits.resize(rayQueue.size());
+
+        ParallelChunks(rayOrder.size(), [this](size_t begin, size_t end, ChunkOutput& output) {
+            Ray rays[RayPacket::MAX_SIZE];
+            bool hitResult[RayPacket::MAX_SIZE];
+            HitRecord hits[RayPacket::MAX_SIZE];
+
+            size_t k = begin;
+            while (k < end) {
+                const PathRay& first = rayQueue[rayOrder[k]];
+                int n = 1;
+                if (first.type == RAY_CAMERA) {
+                    while (n < RayPacket::MAX_SIZE && k + n < end && rayQueue[rayOrder[k + n]].type == RAY_CAMERA &&
+                           rayQueue[rayOrder[k + n]].key == first.key && SamePixel(rayQueue[rayOrder[k + n]], first)) {
+                        n++;
+                    }
+                }
+
+                for (int r = 0; r < n; r++) {
+                    rays[r] = rayQueue[rayOrder[k + r]].ray;
+                    hits[r] = HitRecord();
+                }
+                TracePacket(rays, hits, hitResult, n);
+
+                //Rays that miss keep the initial distance of the hit record
+                for (int r = 0; r < n; r++) {
+                    rayHits[rayOrder[k + r]] = hits[r];
+
+                    if (!hitResult[r]) {
+                        AddMiss(rayQueue[rayOrder[k + r]], output);
+                    }
+                }
+
+                k += n;
+            }
+        });
+
+        AddContributions();
+    }
+
+    //Shade Stage
+    //Same light as PathTrace(), and the same sampler dimensions, the continuation ray is queued instead of traced
+    void ShadeHits()
+    {
+        hitOrder.clear();
+        for (unsigned int i : rayOrder) {
+            if (rayHits[i].z < BIGFLOAT) {
+                hitOrder.push_back(i);
+            }
+        }
+        SortOrder(hitOrder, [this](unsigned int i) { return MaterialKey(rayHits[i]); });
+
+        ParallelChunks(hitOrder.size(), [this](size_t begin, size_t end, ChunkOutput& output) {
+            Sampler& sampler = CurrentSampler();
+
+            for (size_t k = begin; k < end; k++) {
+                PathRay& path = rayQueue[hitOrder[k]];
+                HitInfo hInfo;
+                GetHitInfo(path.ray, rayHits[hitOrder[k]], hInfo);
+                const Material* material = hInfo.node->GetMaterial();
+
+                //Absorption inside a refractive object
+                if (!hInfo.front && path.absorption != Color(0, 0, 0)) {
+                    path.weight *= Color(exp((-hInfo.z)*path.absorption.r),
+                                         exp((-hInfo.z)*path.absorption.g),
+                                         exp((-hInfo.z)*path.absorption.b));
+                }
+
+                StartPathSample(sampler, samples[path.sample], path.dimension);
+
+                if (!RussianRoulette(path.depth, path.weight)) {
+                    continue;
+                }
+
+                //Direct light, the lights that can be occluded wait for their shadow rays
+                for (size_t l = 0; l < lights.size(); l++) {
+                    ShadowRay shadowRay;
+                    Color illumination = lights[l]->SampleIllumination(hInfo.p, shadowRay.ray, shadowRay.t);
+                    Color c = path.weight * material->ShadeLight(hInfo, lights[l], illumination);
+
+                    if (c == Color(0, 0, 0)) {
+                        continue;
+                    }
+
+                    if (shadowRay.t > 0) {
+                        shadowRay.contribution = c;
+                        shadowRay.sample = path.sample;
+                        shadowRay.key = RayKey(shadowRay.ray);
+                        output.shadowRays.push_back(shadowRay);
+                    }
+                    else {
+                        Contribution contribution = {path.sample, c};
+                        output.contributions.push_back(contribution);
+                    }
+                }
+
+                //The rays the path can continue with, the Monte Carlo bounce is the first one
+                SecondaryRay nextRays[Material::MAX_SECONDARY_RAYS + 1];
+                int numOfRays = 0;
+
+                Color indirectWeight = material->GetIndirectWeight(hInfo);
+                if (indirectWeight != Color(0, 0, 0)) {
+                    if (path.diffuseBounces > 0) {
+                        SecondaryRay& indirect = nextRays[numOfRays++];
+                        indirect.ray = Ray(hInfo.p, ToWorld(SampleCosineHemisphere(sampler.Get2D()), hInfo.N).GetNormalized());
+                        indirect.hitWeight = indirectWeight;
+                        indirect.missWeight = indirectWeight;
+                        indirect.absorption = Color(0, 0, 0);
+                    }
+                    else if (path.diffuseBounces == 0) {
+                        Contribution contribution = {path.sample, path.weight * indirectWeight * settings.lastBounceIrradiance};
+                        output.contributions.push_back(contribution);
+                    }
+                }
+                int numOfIndirectRays = numOfRays;
+
+                //Reflection & Refraction
+                if (path.specularBounces > 0) {
+                    numOfRays += material->GetSecondaryRays(path.ray, hInfo, nextRays + numOfRays);
+                }
+
+                //Pick the ray the path continues with
+                Color hitWeight, missWeight;
+                int n = ChoosePathRay(nextRays, numOfRays, path.weight, hitWeight, missWeight);
+
+                if (n < 0) {
+                    continue;
+                }
+
+                output.rays.push_back(path);
+                PathRay& next = output.rays.back();
+                next.ray = nextRays[n].ray;
+                next.weight = hitWeight;
+                next.missWeight = missWeight;
+                next.absorption = nextRays[n].absorption;
+                next.dimension = sampler.GetDimension();
+                next.depth = path.depth + 1;
+
+                if (n < numOfIndirectRays) {
+                    next.diffuseBounces = path.diffuseBounces - 1;
+                    next.specularBounces = settings.specularBounces;
+                    next.type = RAY_INDIRECT;
+                }
+                else {
+                    next.diffuseBounces = -1;
+                    next.specularBounces = path.specularBounces - 1;
+                    next.type = RAY_SECONDARY;
+                }
+                next.key = RayKey(next.ray);
+            }
+        });
+
+        rayQueue.clear();
+        shadowQueue.clear();
+        for (size_t i = 0; i < numChunkOutputs; i++) {
+            rayQueue.insert(rayQueue.end(), chunkOutputs[i].rays.begin(), chunkOutputs[i].rays.end());
+            shadowQueue.insert(shadowQueue.end(), chunkOutputs[i].shadowRays.begin(), chunkOutputs[i].shadowRays.end());
+        }
+        AddContributions();
+    }
+
+    //Shadow Stage
+    void TraceShadowRays()
+    {
+        SortByKey(shadowQueue, shadowOrder);
+
+        //Neighbouring rays of the sorted queue are traced as one packet, same test as GenLight::Shadow()
+        ParallelChunks(shadowOrder.size(), [this](size_t begin, size_t end, ChunkOutput& output) {
+            for (size_t k = begin; k < end; k += RayPacket::MAX_SIZE) {
+                int count = (end - k < RayPacket::MAX_SIZE) ? (int)(end - k) : (int)RayPacket::MAX_SIZE;
+
+                Ray rays[RayPacket::MAX_SIZE];
+                float t[RayPacket::MAX_SIZE];
+                bool occluded[RayPacket::MAX_SIZE];
+                for (int i = 0; i < count; i++) {
+                    rays[i] = shadowQueue[shadowOrder[k + i]].ray;
+                    t[i] = shadowQueue[shadowOrder[k + i]].t;
+                }
+
+                ShadowTracePacket(rays, t, occluded, count);
+
+                for (int i = 0; i < count; i++) {
+                    if (!occluded[i]) {
+                        const ShadowRay& shadowRay = shadowQueue[shadowOrder[k + i]];
+                        Contribution contribution = {shadowRay.sample, shadowRay.contribution};
+                        output.contributions.push_back(contribution);
+                    }
+                }
+            }
+        });
+
+        AddContributions();
+    }
+
+    //Light from outside the scene, the background for camera rays and the environment for the other rays
+    void AddMiss(const PathRay& path, ChunkOutput& output) const
+    {
+        if (path.missWeight == Color(0, 0, 0)) {
+            return;
+        }
+
+        Color c;
+        if (path.type == RAY_CAMERA) {
+            const Pixel& pixel = pixels[samples[path.sample].pixel];
+            c = background.Sample(Point3((float)pixel.x/camera.imgWidth, (float)pixel.y/camera.imgHeight, 0));
+        }
+        else {
+            c = environment.SampleEnvironment(path.ray.dir);
+        }
+
+        Contribution contribution = {path.sample, path.missWeight * c};
+        output.contributions.push_back(contribution);
+    }
+
+    //Returns an unused entry of the list, the slot of a finished entry if there is one
+    template <typename T>
+    static unsigned int AllocateSlot(std::vector<T>& list, std::vector<unsigned int>& freeSlots)
+    {
+        if (freeSlots.empty()) {
+            list.push_back(T());
+            return (unsigned int)(list.size() - 1);
+        }
+
+        unsigned int slot = freeSlots.back();
+        freeSlots.pop_back();
+        return slot;
+    }
+
+    bool SamePixel(const PathRay& a, const PathRay& b) const
+    {
+        return samples[a.sample].pixel == samples[b.sample].pixel;
+    }
+
+    //Adds the light found by the last stage to the samples, in chunk order
+    void AddContributions()
+    {
+        for (size_t i = 0; i < numChunkOutputs; i++) {
+            for (const Contribution& c : chunkOutputs[i].contributions) {
+                samples[c.sample].radiance += c.color;
+            }
+        }
+    }
+
+    //Same sample sequence as RenderPixel, so a path does not depend on the thread or the stage order
+    void StartPathSample(Sampler& sampler, const Sample& sample, unsigned int dimension) const
+    {
+        const Pixel& pixel = pixels[sample.pixel];
+        sampler.StartPixel(settings.seed, pixel.x + renderImage.GetWidth()*pixel.y);
+        sampler.StartSample(sample.index, dimension);
+    }
+
+    //Octant of the direction in the top 3 bits, then the Morton code of the origin on the 512^3 grid
+    unsigned int RayKey(const Ray& r) const
+    {
+        unsigned int key = (unsigned int)((r.sign[0] << 2) | (r.sign[1] << 1) | r.sign[2]) << 27;
+
+        for (int i = 0; i < 3; i++) {
+            float g = (r.p[i] - sceneMin[i]) * sceneScale[i];
+            unsigned int cell = (g > 0.0f) ? (unsigned int)(g < 511.0f ? g : 511.0f) : 0;
+            key |= ExpandBits(cell) << (2 - i);
+        }
+        return key;
+    }
+
+    //Spreads the 9 bits of v to every third bit
+    static unsigned int ExpandBits(unsigned int v)
+    {
+        v = (v | (v << 16)) & 0x030000FF;
+        v = (v | (v <<  8)) & 0x0300F00F;
+        v = (v | (v <<  4)) & 0x030C30C3;
+        v = (v | (v <<  2)) & 0x09249249;
+        return v;
+    }
+
+    unsigned int MaterialKey(const HitRecord& hit) const
+    {
+        auto m = materialKeys.find(sceneBVH.GetInstance(hit.instance).node->GetMaterial());
+        return (m != materialKeys.end()) ? m->second : 0xFFFFFFFF;
+    }
+
+    //Fills order with the indices of the queue, sorted by the key of the entries
+    template <typename T>
+    void SortByKey(const std::vector<T>& queue, std::vector<unsigned int>& order)
+    {
+        order.resize(queue.size());
+        for (size_t i = 0; i < queue.size(); i++) {
+            order[i] = (unsigned int)i;
+        }
+        SortOrder(order, [&queue](unsigned int i) { return queue[i].key; });
+    }
+
+    //Sorts a list of indices by key(index), indices with the same key keep their order
+    template <typename Key>
+    void SortOrder(std::vector<unsigned int>& order, const Key& key)
+    {
+        sortKeys.resize(order.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            sortKeys[i] = ((uint64_t)key(order[i]) << 32) | (uint64_t)i;
+        }
+        std::sort(sortKeys.begin(), sortKeys.end());
+
+        sortedOrder.resize(order.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            sortedOrder[i] = order[sortKeys[i] & 0xFFFFFFFF];
+        }
+        order.swap(sortedOrder);
+    }
+
+    //Runs job(begin, end, output) on chunks of [0, count) on all workers of the pool
+    //Chunk c writes to chunkOutputs[c], which is cleared first
+    //A single chunk is run on the calling thread, the small queues at the end of a frame do not wake the pool
+    template <typename Job>
+    void ParallelChunks(size_t count, const Job& job)
+    {
+        size_t chunkSize = (size_t)settings.chunkSize;
+        size_t numChunks = (count + chunkSize - 1) / chunkSize;
+
+        if (chunkOutputs.size() < numChunks) {
+            chunkOutputs.resize(numChunks);
+        }
+        for (size_t c = 0; c < numChunks; c++) {
+            chunkOutputs[c].Clear();
+        }
+        numChunkOutputs = numChunks;
+
+        if (numChunks <= 1) {
+            if (numChunks == 1) {
+                job(0, count, chunkOutputs[0]);
+            }
+            return;
+        }
+
+        std::atomic_size_t nextChunk{0};
+        pool->Run([&] {
+            size_t c;
+            while (!cancelled && (c = nextChunk++) < numChunks) {
+                size_t chunkEnd = (c + 1) * chunkSize;
+                job(c * chunkSize, (chunkEnd < count) ? chunkEnd : count, chunkOutputs[c]);
+            }
+        }, [this] { Cancel(); });
+        pool->Wait();
+    }
+};
+
+#endif /* WavefrontRenderer_h */
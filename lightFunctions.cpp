@@ -9,15 +9,15 @@
 #include "ExternalLibrary/lights.h"
 #include "ExternalLibrary/scene.h"
 #include "RenderFunctions.h"
+#include "Sampling.h"
 
-extern Node rootNode;
 extern LightList lights;
 
 int shadowSampleMax = 1;
 int shadowSampleMin = 1;
 
 Ray PointLight::RandomPhoton() const {
-    Point3 dir = SampleSphere(position, 1.0);
+    Point3 dir = SampleUniformSphere(NextSample2D());
     
     Ray result = Ray(position, dir.GetNormalized());
     
@@ -25,60 +25,42 @@ Ray PointLight::RandomPhoton() const {
 }
 
 float GenLight::Shadow(Ray ray, float t_max) {
-    HitInfo h;
-    h.z = t_max;
-    
-    if (ShadowTrace(ray, &rootNode, h)) {
-        if (h.z > 0.0) {
-            return 0.0;
-        }
+    if (ShadowTrace(ray, t_max)) {
+        return 0.0;
     }
     return 1.0;
 }
 
 Color PointLight::Illuminate(const Point3 &p, const Point3 &N) const {
-    float shadowIntensity = 0.0;
-    float result = 1.0;
+    Ray shadowRay;
+    float shadowT;
+    Color illumination = SampleIllumination(p, shadowRay, shadowT);
+    
+    return Shadow(shadowRay, shadowT) * illumination;
+}
 
+Color PointLight::SampleIllumination(const Point3 &p, Ray &shadowRay, float &shadowT) const {
     if (size > 0) {
-        // Perform minimum shadow sample
-//        for (int i = 0; i < shadowSampleMax; i++) {
-            // Generate random sample
-            float sampleR = static_cast <float> (rand()) / (static_cast <float> (RAND_MAX/size));
-            float sampleTheta = static_cast <float> (rand()) / (static_cast <float> (RAND_MAX/(2 * M_PI)));
-            float offsetX = sampleR * cos(sampleTheta);
-            float offsetY = sampleR * sin(sampleTheta);
-            
-            Point3 samplePlaneNormal = (position - p).GetNormalized();
-            
-            // Find two random vectors perpendicular to N to construct coord sys
-            Point3 v1 = samplePlaneNormal.Cross(Point3(0,0,1)).GetNormalized();
-            Point3 v2 = v1.Cross(samplePlaneNormal).GetNormalized();
-            
-            Point3 currentSamplePos = position + v1*offsetX + v2*offsetY;
-            
-            Ray shadowRay = Ray(p, (currentSamplePos - p).GetNormalized());
-            
-            shadowIntensity += Shadow(shadowRay, (p-currentSamplePos).Length());
+        // One shadow ray per sample, towards a random point on the light disk
+        Point2 offset = SampleConcentricDisk(NextSample2D()) * size;
+        float offsetX = offset.x;
+        float offsetY = offset.y;
         
-//        One Shadow ray per sample
-        result = shadowIntensity;
+        Point3 samplePlaneNormal = (position - p).GetNormalized();
         
-//            if (i == shadowSampleMin) {
-//                if (shadowIntensity == shadowSampleMin*1.0) {
-//                    return intensity;
-//                }
-//            }
-//        }
-//        result = shadowIntensity/(float)shadowSampleMax;
-    }
-    else {
-        Ray shadowRay = Ray(p, (position - p).GetNormalized());
+        // Find two vectors perpendicular to N to construct coord sys
+        Point3 v1, v2;
+        OrthonormalBasis(samplePlaneNormal, v1, v2);
         
-        shadowIntensity += Shadow(shadowRay, (position-p).Length());
+        Point3 currentSamplePos = position + v1*offsetX + v2*offsetY;
         
-        result = shadowIntensity;
+        shadowRay = Ray(p, (currentSamplePos - p).GetNormalized());
+        shadowT = (p-currentSamplePos).Length();
+    }
+    else {
+        shadowRay = Ray(p, (position - p).GetNormalized());
+        shadowT = (position-p).Length();
     }
     
-    return result * intensity * (1/(position - p).LengthSquared());
+    return intensity * (1/(position - p).LengthSquared());
 }
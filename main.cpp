@@ -7,8 +7,13 @@
 #include "ExternalLibrary/lodepng.cpp"
 #include "ExternalLibrary/cyPhotonMap.h"
 #include "RenderFunctions.cpp"
-#include "PixelIterator.h"
+#include "TileIterator.h"
+#include "SceneBVH.h"
+#include "RenderThreadPool.h"
+#include "CameraRayGenerator.h"
+#include "WavefrontRenderer.h"
 #include <thread>
+#include <string.h>
 
 //TODO --------------
 
@@ -16,9 +21,11 @@
 //Define & Init Data Stuctures
 RenderImage renderImage;
 Camera camera;
+CameraRayGenerator cameraRays;
 Sphere theSphere;
 Plane thePlane;
 Node rootNode;
+SceneBVH sceneBVH;
 MaterialList materials;
 LightList lights;
 ObjFileList objList;
@@ -26,6 +33,11 @@ TexturedColor background;
 TexturedColor environment;
 TextureList textureList;
 
+//Defined last, so the workers are stopped before the scene is destroyed
+RenderThreadPool renderPool;
+WavefrontRenderer wavefrontRenderer;
+bool wavefrontRendering = false;     //Render with queues of rays per stage instead of pixel by pixel
+
 void SpawnRenderThreads() {
     // Generate Photon Map before rendering
 //    GeneratePhotonMap();
@@ -35,32 +47,42 @@ void SpawnRenderThreads() {
 //    fclose(fp);
     
     //Multi Thread Rendering
-    PixelIterator i = PixelIterator();
-    int CPUCoreNumber = std::thread::hardware_concurrency();
-
-    if (CPUCoreNumber == 0) {
-        CPUCoreNumber = 1;
-    }
+    //Threads claim 16x16 tiles along a Morton curve
+    TileIterator i(renderImage.GetWidth(), renderImage.GetHeight(), 16, TILE_ORDER_MORTON);
+    renderImage.ResetNumRenderedPixels();
+    
+    //The camera is fixed during a frame, set up the image plane once
+    cameraRays.Init(camera);
 
 //    #if DEBUG
 //    DEBUG PURPOSE
-//        CPUCoreNumber = 1;
+//        renderPool.SetNumThreads(1);
 //    #endif
 
-    for (int j = 0; j < CPUCoreNumber; j++) {
-        std::thread(Render, std::ref(i)).detach();
+    //The workers of the pool are reused for every frame
+    if (wavefrontRendering) {
+        RenderWavefront(i);
     }
-
-    while (!i.IterationComplete()) {
-
+    else {
+        renderPool.Run([&i] { Render(i); }, [&i] { i.Cancel(); });
+        renderPool.Wait();
+    }
+    
+    if (i.IsCancelled()) {
+        printf("Render stopped\n");
+        return;
     }
     
     //Output Image
     renderImage.SaveImage("Result.png");
     renderImage.ComputeZBufferImage();
     renderImage.SaveZImage("ZBuffer.png");
-//    renderImage.ComputeSampleCountImage();
-//    renderImage.SaveSampleCountImage("SampleCount.png");
+    renderImage.ComputeSampleCountImage();
+    renderImage.SaveSampleCountImage("SampleCount.png");
+    
+    //Report the hot regions of the frame
+    i.PrintTileTimes();
+    i.SaveTileTimeImage("TileTime.png");
 }
 
 void BeginRender() {
@@ -68,14 +90,16 @@ void BeginRender() {
 }
 
 void StopRender() {
-    
+    //Stop handing out tiles, SpawnRenderThreads returns once the workers are done
+    renderPool.Cancel();
+    wavefrontRenderer.Cancel();
 }
 
 int main(int argc, const char* argv[]) 
 {
     const char* sceneFile;
     
-    if (argc == 2) {
+    if (argc >= 2) {
         sceneFile = argv[1];
         LoadScene(sceneFile);
     }
@@ -84,5 +108,18 @@ int main(int argc, const char* argv[])
         LoadScene("/Users/Peter/GitRepos/RayTracer-Utah/SceneFiles/Teapot/scene2.xml");
     }
     
+    //Optional number of render threads, all hardware threads by default
+    if (argc >= 3) {
+        renderPool.SetNumThreads(atoi(argv[2]));
+    }
+    
+    //Optional render mode, "wavefront" traces the rays of many pixels together, one stage at a time
+    if (argc >= 4 && strcmp(argv[3], "wavefront") == 0) {
+        wavefrontRendering = true;
+    }
+    
+    //Build the top level acceleration structure over all object instances
+    sceneBVH.SetScene(&rootNode);
+    
     ShowViewport();
 }
@@ -10,10 +10,10 @@
 #include "ExternalLibrary/materials.h"
 #include "ExternalLibrary/scene.h"
 #include "RenderFunctions.h"
+#include "Sampling.h"
 #include <math.h>
 
 extern Camera camera;
-extern Node rootNode;
 extern TexturedColor environment;
 
 bool MtlBlinn::RandomPhotonBounce(Ray &r, Color &c, HitInfo &hInfo) const
@@ -33,7 +33,7 @@ bool MtlBlinn::RandomPhotonBounce(Ray &r, Color &c, HitInfo &hInfo) const
     sumGray = 1.0;
     
     // Calculate Probability
-    float graySample = static_cast <float> (rand()) / (static_cast <float> (RAND_MAX/sumGray));
+    float graySample = CurrentSampler().Get1D() * sumGray;
     
     // Decide Bounce type
     if (graySample > diffuseGray)
@@ -47,7 +47,7 @@ bool MtlBlinn::RandomPhotonBounce(Ray &r, Color &c, HitInfo &hInfo) const
                 // Refraction
                 //Calculate the reflected ray direction
                 Point3 sampleOrigin = hInfo.p+hInfo.N;
-                Point3 sampledOffset = SampleSphere(sampleOrigin, refractionGlossiness);
+                Point3 sampledOffset = SampleUniformBall(NextSample3D()) * refractionGlossiness;
                 Point3 sampledNormal = (sampleOrigin + sampledOffset - hInfo.p).GetNormalized();
                 
                 //Calcluate the refracted ray direction
@@ -98,7 +98,7 @@ bool MtlBlinn::RandomPhotonBounce(Ray &r, Color &c, HitInfo &hInfo) const
         }
         else {
             // Specular Bounce
-            Point3 direction = SampleSphere(hInfo.p, 1.0);
+            Point3 direction = SampleUniformSphere(NextSample2D());
             r = Ray(hInfo.p, direction);
             
             c *= specular.Sample(hInfo.uvw) / (specularGray/sumGray);
@@ -107,50 +107,30 @@ bool MtlBlinn::RandomPhotonBounce(Ray &r, Color &c, HitInfo &hInfo) const
     }
     else {
         // Diffuse Bounce
-        Point3 direction = SampleSphere(hInfo.p, 1.0);
+        Point3 direction = SampleUniformSphere(NextSample2D());
         r = Ray(hInfo.p, direction);
         
         c *= diffuse.Sample(hInfo.uvw) / (diffuseGray/sumGray);
 //        c *= diffuse.Sample(hInfo.uvw);
     }
     
-    return Trace(r, &rootNode, hInfo);
+    return Trace(r, hInfo);
 }
 
-Color MtlBlinn::Shade(const Ray &ray, const HitInfo &hInfo, const LightList &lights, int bounceCount) const
+Color MtlBlinn::Shade(const Ray &ray, const HitInfo &hInfo, const LightList &lights, int bounceCount, const Color &indirect) const
 {
     Color result = Color(0,0,0);
     
     //Only shade front faces
     if (hInfo.front) {
+        //Indirect light, same as an ambient light
+        result += diffuse.Sample(hInfo.uvw) * indirect;
+        
         //Iterate through each light
         for (int i = 0; i < lights.size(); i++) {
             Light* currentLight = lights[i];
             
-            //Ambient Light
-            if (currentLight->IsAmbient()) {
-                result += diffuse.Sample(hInfo.uvw) * currentLight->Illuminate(hInfo.p, hInfo.N);
-            }
-            
-            //Shading Happens in World Space
-            else {
-                Point3 viewDirection = (camera.pos - hInfo.p).GetNormalized();
-                Point3 lightDirection = (-(currentLight->Direction(hInfo.p))).GetNormalized();
-                Point3 halfVector = (viewDirection+lightDirection).GetNormalized();
-                
-                float NDotL = hInfo.N.Dot(lightDirection);
-                float NDotH = hInfo.N.Dot(halfVector);
-                
-                if (NDotL < 0.0) {
-                    NDotL = 0.0;
-                }
-                
-                if (NDotH < 0.0) {
-                    NDotH = 0.0;
-                }
-                
-                result += currentLight->Illuminate(hInfo.p, hInfo.N)*NDotL*(diffuse.Sample(hInfo.uvw)+specular.Sample(hInfo.uvw)*pow(NDotH, glossiness));
-            }
+            result += ShadeLight(hInfo, currentLight, currentLight->Illuminate(hInfo.p, hInfo.N));
         }
     }
     
@@ -161,7 +141,7 @@ Color MtlBlinn::Shade(const Ray &ray, const HitInfo &hInfo, const LightList &lig
             
             // Glossiness Sampling
             Point3 sampleOrigin = hInfo.p+hInfo.N;
-            Point3 sampledOffset = SampleSphere(sampleOrigin, refractionGlossiness);
+            Point3 sampledOffset = SampleUniformBall(NextSample3D()) * refractionGlossiness;
             Point3 sampledNormal = (sampleOrigin + sampledOffset - hInfo.p).GetNormalized();
             
             //Calcluate the refracted ray direction
@@ -214,7 +194,7 @@ Color MtlBlinn::Shade(const Ray &ray, const HitInfo &hInfo, const LightList &lig
                                           exp((-reflectedHInfo.z)*absorption.g),
                                           exp((-reflectedHInfo.z)*absorption.b));
                 
-                if (Trace(reflected, &rootNode, reflectedHInfo)) {
+                if (Trace(reflected, reflectedHInfo)) {
                     Color TIRResult = absorptionV * reflectedHInfo.node->GetMaterial()->Shade(reflected, reflectedHInfo, lights, bounceCount-1);
                     
                     result += TIRResult;
@@ -223,7 +203,7 @@ Color MtlBlinn::Shade(const Ray &ray, const HitInfo &hInfo, const LightList &lig
             else {
                 // Glossiness Sampling
                 Point3 sampleOrigin = hInfo.p+hInfo.N;
-                Point3 sampledOffset = SampleSphere(sampleOrigin, refractionGlossiness);
+                Point3 sampledOffset = SampleUniformBall(NextSample3D()) * refractionGlossiness;
                 Point3 sampledNormal = (sampleOrigin + sampledOffset - hInfo.p).GetNormalized();
                 
                 Point3 refractedDirection = (-(sampledNormal)*cosTheta2 + SVector*sinTheta2).GetNormalized();
@@ -231,7 +211,7 @@ Color MtlBlinn::Shade(const Ray &ray, const HitInfo &hInfo, const LightList &lig
                 Ray refracted = Ray(hInfo.p, refractedDirection);
                 HitInfo refractedHInfo;
                 
-                if (Trace(refracted, &rootNode, refractedHInfo)) {
+                if (Trace(refracted, refractedHInfo)) {
                     //Fresnel Reflection
                     float R0 = pow((n1-n2)/(n1+n2), 2);
                     float ShlicksApprox = R0 + (1.0-R0)*pow((1.0-cosTheta1), 5);
@@ -243,7 +223,7 @@ Color MtlBlinn::Shade(const Ray &ray, const HitInfo &hInfo, const LightList &lig
                     
                     Color frenselResult = Color(0.0, 0.0, 0.0);
                     
-                    if (Trace(reflected, &rootNode, reflectedHInfo)) {
+                    if (Trace(reflected, reflectedHInfo)) {
                         frenselResult = refraction.Sample(hInfo.uvw) * reflectedHInfo.node->GetMaterial()->Shade(reflected, reflectedHInfo, lights, bounceCount-1);
                     }
                     else {
@@ -273,7 +253,7 @@ Color MtlBlinn::Shade(const Ray &ray, const HitInfo &hInfo, const LightList &lig
         if (reflection.Sample(hInfo.uvw) != Color(0,0,0)) {
             // Glossiness Sampling
             Point3 sampleOrigin = hInfo.p+hInfo.N;
-            Point3 sampledOffset = SampleSphere(sampleOrigin, reflectionGlossiness);
+            Point3 sampledOffset = SampleUniformBall(NextSample3D()) * reflectionGlossiness;
             Point3 sampledNormal = (sampleOrigin + sampledOffset - hInfo.p).GetNormalized();
             
             //Calculate the reflected ray direction
@@ -282,7 +262,7 @@ Color MtlBlinn::Shade(const Ray &ray, const HitInfo &hInfo, const LightList &lig
             Ray reflected = Ray(hInfo.p, reflectedDirection);
             HitInfo reflectedHInfo;
             
-            if (Trace(reflected, &rootNode, reflectedHInfo)) {
+            if (Trace(reflected, reflectedHInfo)) {
                 result += reflection.Sample(hInfo.uvw) * reflectedHInfo.node->GetMaterial()->Shade(reflected, reflectedHInfo, lights, bounceCount-1);
             }
             else {
@@ -297,4 +277,110 @@ Color MtlBlinn::Shade(const Ray &ray, const HitInfo &hInfo, const LightList &lig
     return result;
 }
 
+//Direct light of one light, the light loop of Shade()
+Color MtlBlinn::ShadeLight(const HitInfo &hInfo, const Light *light, const Color &illumination) const
+{
+    //Only shade front faces
+    if (!hInfo.front) {
+        return Color(0,0,0);
+    }
+    
+    //Ambient Light
+    if (light->IsAmbient()) {
+        return diffuse.Sample(hInfo.uvw) * illumination;
+    }
+    
+    //Shading Happens in World Space
+    Point3 viewDirection = (camera.pos - hInfo.p).GetNormalized();
+    Point3 lightDirection = (-(light->Direction(hInfo.p))).GetNormalized();
+    Point3 halfVector = (viewDirection+lightDirection).GetNormalized();
+    
+    float NDotL = hInfo.N.Dot(lightDirection);
+    float NDotH = hInfo.N.Dot(halfVector);
+    
+    if (NDotL < 0.0) {
+        NDotL = 0.0;
+    }
+    
+    if (NDotH < 0.0) {
+        NDotH = 0.0;
+    }
+    
+    return illumination*NDotL*(diffuse.Sample(hInfo.uvw)+specular.Sample(hInfo.uvw)*pow(NDotH, glossiness));
+}
 
+//Reflection and refraction rays of Shade(), for the wavefront renderer and PathTrace()
+//The weights follow Shade(), except that the Fresnel reflection is kept when the refracted ray leaves the scene
+int MtlBlinn::GetSecondaryRays(const Ray &ray, const HitInfo &hInfo, SecondaryRay *rays) const
+{
+    int numOfRays = 0;
+    
+    //If a refraction property exists
+    if (refraction.Sample(hInfo.uvw) != Color(0,0,0)) {
+        //Spheres and planes flip the normal of a back face hit, meshes do not, the angles below need it towards the ray
+        Point3 N = (hInfo.N.Dot(ray.dir) > 0) ? -hInfo.N : hInfo.N;
+        
+        // Glossiness Sampling
+        Point3 sampleOrigin = hInfo.p+N;
+        Point3 sampledOffset = SampleUniformBall(NextSample3D()) * refractionGlossiness;
+        Point3 sampledNormal = (sampleOrigin + sampledOffset - hInfo.p).GetNormalized();
+        
+        float cosTheta1 = fmaxf(-1.0f, fminf(1.0f, sampledNormal.Dot(-ray.dir)));
+        float sinTheta1 = sqrtf(fmaxf(0.0f, 1-cosTheta1*cosTheta1));
+        
+        //If front face hit, n2 = object ior, else n1 = object ior
+        float n1 = hInfo.front ? 1.0 : ior;
+        float n2 = hInfo.front ? ior : 1.0;
+        
+        float sinTheta2 = (n1/n2) * sinTheta1;
+        
+        if (sinTheta2 > 1) {
+            //Total Internal Reflection, the ray stays inside and is absorbed up to its next hit, same as the refracted ray
+            SecondaryRay &reflected = rays[numOfRays++];
+            reflected.ray = Ray(hInfo.p, (ray.dir - 2*ray.dir.Dot(sampledNormal)*sampledNormal).GetNormalized());
+            reflected.hitWeight = refraction.Sample(hInfo.uvw);
+            reflected.missWeight = Color(0,0,0);
+            reflected.absorption = absorption;
+        }
+        else {
+            float cosTheta2 = fminf(1.0f, sqrtf(1 - sinTheta2 * sinTheta2));
+            Point3 SVector = sampledNormal.Cross(sampledNormal.Cross(-ray.dir).GetNormalized()).GetNormalized();
+            
+            // Glossiness Sampling, Shade() samples a second normal for the refracted and reflected rays
+            sampledOffset = SampleUniformBall(NextSample3D()) * refractionGlossiness;
+            sampledNormal = (sampleOrigin + sampledOffset - hInfo.p).GetNormalized();
+            
+            //Fresnel Reflection
+            float R0 = pow((n1-n2)/(n1+n2), 2);
+            float ShlicksApprox = R0 + (1.0-R0)*pow((1.0-cosTheta1), 5);
+            
+            SecondaryRay &refracted = rays[numOfRays++];
+            refracted.ray = Ray(hInfo.p, (-(sampledNormal)*cosTheta2 + SVector*sinTheta2).GetNormalized());
+            refracted.hitWeight = refraction.Sample(hInfo.uvw) * (1.0-ShlicksApprox);
+            refracted.missWeight = Color(1,1,1);
+            refracted.absorption = absorption;
+            
+            SecondaryRay &reflected = rays[numOfRays++];
+            reflected.ray = Ray(hInfo.p, (ray.dir - 2*ray.dir.Dot(sampledNormal)*sampledNormal).GetNormalized());
+            reflected.hitWeight = refraction.Sample(hInfo.uvw) * ShlicksApprox;
+            reflected.missWeight = Color(ShlicksApprox, ShlicksApprox, ShlicksApprox);
+            reflected.absorption = Color(0,0,0);
+        }
+    }
+    
+    //If a reflection property exists
+    if (reflection.Sample(hInfo.uvw) != Color(0,0,0)) {
+        // Glossiness Sampling
+        Point3 sampleOrigin = hInfo.p+hInfo.N;
+        Point3 sampledOffset = SampleUniformBall(NextSample3D()) * reflectionGlossiness;
+        Point3 sampledNormal = (sampleOrigin + sampledOffset - hInfo.p).GetNormalized();
+        
+        SecondaryRay &reflected = rays[numOfRays++];
+        reflected.ray = Ray(hInfo.p, (ray.dir - 2*ray.dir.Dot(sampledNormal)*sampledNormal).GetNormalized());
+        reflected.hitWeight = reflection.Sample(hInfo.uvw);
+        reflected.missWeight = reflection.GetColor();
+        reflected.absorption = Color(0,0,0);
+    }
+    
+    return numOfRays;
+}
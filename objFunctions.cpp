@@ -12,124 +12,78 @@
 #include <vector>
 
 //Sphere Intersection
-bool Sphere::IntersectRay(const Ray &ray, HitInfo &hInfo, int hitSide) const
+//Only finds the distance, primitive 0 is the outside of the sphere and primitive 1 is the inside
+bool Sphere::IntersectHit(const Ray &ray, HitRecord &hit, int hitSide) const
 {
-    if (GetBoundBox().IntersectRay(ray, BIGFLOAT)) {
-        float a,b,c,m,n,sqrtCheck;
-        
-        a = ray.dir.Dot(ray.dir);
-        b = 2*((ray.p - Point3(0,0,0)).Dot(ray.dir));
-        c = ray.p.Dot(ray.p) - 1;
-        
-        sqrtCheck = b*b-4*a*c;
-        
-        m = (-b+sqrt(sqrtCheck))/(2*a);
-        n = (-b-sqrt(sqrtCheck))/(2*a);
-        
-        if (m == n && m < hInfo.z && m >= 0.001) {
-            hInfo.z = m;
-            hInfo.front = true;
-            
-            Point3 temp = ray.p + hInfo.z * ray.dir;
-            
-            hInfo.N = temp.GetNormalized();
-            hInfo.p = temp;
-            
-            float u = 0.5-atan2(hInfo.N.x, hInfo.N.y)/(2*M_PI);
-            float v = 0.5+asin(hInfo.N.z)/M_PI;
-            
-            hInfo.uvw = Point3(u,v,0);
-            
-            return true;
-        }
-        else if (m < n  && m < hInfo.z && (m >= 0.001 | n >= 0.001)) {
-            if (m <= 0.001 && n > 0.001 && n < hInfo.z) {
-                hInfo.z = n;
-                hInfo.front = false;
-            }
-            else if (m > 0.001) {
-                hInfo.z = m;
-                hInfo.front = true;
-            }
-            
-            Point3 temp = ray.p + hInfo.z * ray.dir;
-            
-            if (hInfo.front) {
-                hInfo.N = temp.GetNormalized();
-            }
-            else {
-                hInfo.N = -temp.GetNormalized();
-            }
-            
-            hInfo.p = temp;
-            
-            float u = 0.5-atan2(hInfo.N.x, hInfo.N.y)/(2*M_PI);
-            float v = 0.5+asin(hInfo.N.z)/M_PI;
-            
-            hInfo.uvw = Point3(u,v,0);
-            
-            return true;
-        }
-        else if (n < m && n < hInfo.z && (m >= 0.001 | n >= 0.001)) {
-            if (n <= 0.001 && m > 0.001 && m < hInfo.z) {
-                hInfo.z = m;
-                hInfo.front = false;
-            }
-            else if (n > 0.001) {
-                hInfo.z = n;
-                hInfo.front = true;
-            }
-            
-            Point3 temp = ray.p + hInfo.z * ray.dir;
-            
-            if (hInfo.front) {
-                hInfo.N = temp.GetNormalized();
-            }
-            else {
-                hInfo.N = -temp.GetNormalized();
-            }
-            
-            hInfo.p = temp;
-            
-            float u = 0.5-atan2(hInfo.N.x, hInfo.N.y)/(2*M_PI);
-            float v = 0.5+asin(hInfo.N.z)/M_PI;
-            
-            hInfo.uvw = Point3(u,v,0);
-            
-            return true;
-        }
+    if (!GetBoundBox().IntersectRay(ray, hit.z)) {
+        return false;
+    }
+    
+    float a = ray.dir.Dot(ray.dir);
+    float b = 2*(ray.p.Dot(ray.dir));
+    float c = ray.p.Dot(ray.p) - 1;
+    
+    float sqrtCheck = b*b-4*a*c;
+    if (sqrtCheck < 0) {
+        return false;
+    }
+    
+    //n is the near root and m is the far root
+    float m = (-b+sqrt(sqrtCheck))/(2*a);
+    float n = (-b-sqrt(sqrtCheck))/(2*a);
+    
+    if (n > 0.001 && n < hit.z) {
+        hit.z = n;
+        hit.primitive = 0;
+        return true;
+    }
+    
+    //The ray starts inside the sphere
+    if (n <= 0.001 && m > 0.001 && m < hit.z) {
+        hit.z = m;
+        hit.primitive = 1;
+        return true;
     }
     
     return false;
 }
 
+//Fill in hitinfo for the closest hit
+void Sphere::SetHitInfo(const Ray &ray, const HitRecord &hit, HitInfo &hInfo) const
+{
+    Point3 temp = ray.p + hit.z * ray.dir;
+    
+    hInfo.z = hit.z;
+    hInfo.front = hit.primitive == 0;
+    
+    if (hInfo.front) {
+        hInfo.N = temp.GetNormalized();
+    }
+    else {
+        hInfo.N = -temp.GetNormalized();
+    }
+    
+    hInfo.p = temp;
+    
+    float u = 0.5-atan2(hInfo.N.x, hInfo.N.y)/(2*M_PI);
+    float v = 0.5+asin(hInfo.N.z)/M_PI;
+    
+    hInfo.uvw = Point3(u,v,0);
+}
+
 //Plane Intersection
-bool Plane::IntersectRay(const Ray &ray, HitInfo &hInfo, int hitSide) const
+bool Plane::IntersectHit(const Ray &ray, HitRecord &hit, int hitSide) const
 {
-    if (GetBoundBox().IntersectRay(ray, BIGFLOAT)) {
+    if (GetBoundBox().IntersectRay(ray, hit.z)) {
         if (ray.dir.z != 0) {
             float t = (-ray.p.z)/(ray.dir.z);
             
-            if (t > 0.001 && t < hInfo.z) {
+            if (t > 0.001 && t < hit.z) {
                 Point3 q = ray.p + ray.dir*t;
                 
                 if (q.x > -1 && q.x < 1 &&
                     q.y > -1 && q.y < 1) {
-                    
-                    if (ray.p.z > 0) {
-                        hInfo.front = true;
-                        hInfo.N = Point3(0,0,1);
-                    }
-                    else {
-                        hInfo.front = false;
-                        hInfo.N = Point3(0,0,-1);
-                    }
-                    
-                    q = Point3(q.x, q.y, 0);
-                    hInfo.z = t;
-                    hInfo.p = q;
-                    hInfo.uvw = Point3((q.x+1)/2, (q.y+1)/2, 0);
-                    
+                    hit.z = t;
                     return true;
                 }
             }
@@ -139,187 +93,377 @@ bool Plane::IntersectRay(const Ray &ray, HitInfo &hInfo, int hitSide) const
     return false;
 }
 
-//Bounding Box Intersection
-bool Box::IntersectRay(const Ray &r, float t_max) const {
-    Point3 allMin = pmin;
-    Point3 allMax = pmax;
-    float tEntry;
-    float tExit;
-    
-    //Special Cases
-    if (IsEmpty()) {
+//Fill in hitinfo for the closest hit
+void Plane::SetHitInfo(const Ray &ray, const HitRecord &hit, HitInfo &hInfo) const
+{
+    Point3 q = ray.p + ray.dir*hit.z;
+    
+    if (ray.p.z > 0) {
+        hInfo.front = true;
+        hInfo.N = Point3(0,0,1);
+    }
+    else {
+        hInfo.front = false;
+        hInfo.N = Point3(0,0,-1);
+    }
+    
+    q = Point3(q.x, q.y, 0);
+    hInfo.z = hit.z;
+    hInfo.p = q;
+    hInfo.uvw = Point3((q.x+1)/2, (q.y+1)/2, 0);
+}
+
+//Sphere Shadow Intersection
+//Only checks whether one of the two roots is in front of the ray and closer than t_max
+bool Sphere::IntersectShadow(const Ray &ray, float t_max) const
+{
+    if (!GetBoundBox().IntersectRay(ray, t_max)) {
         return false;
     }
     
-    if (r.dir.x == 0) {
-        //Parallel to X Plane
-        float ty0 = (allMin.y - r.p.y)/r.dir.y;
-        float ty1 = (allMax.y - r.p.y)/r.dir.y;
-        float tz0 = (allMin.z - r.p.z)/r.dir.z;
-        float tz1 = (allMax.z - r.p.z)/r.dir.z;
+    float a = ray.dir.Dot(ray.dir);
+    float b = 2*(ray.p.Dot(ray.dir));
+    float c = ray.p.Dot(ray.p) - 1;
+    
+    float sqrtCheck = b*b-4*a*c;
+    if (sqrtCheck < 0) {
+        return false;
+    }
+    
+    float m = (-b+sqrt(sqrtCheck))/(2*a);
+    float n = (-b-sqrt(sqrtCheck))/(2*a);
+    
+    return (m >= 0.001 && m < t_max) || (n >= 0.001 && n < t_max);
+}
+
+//Plane Shadow Intersection
+bool Plane::IntersectShadow(const Ray &ray, float t_max) const
+{
+    if (ray.dir.z == 0) {
+        return false;
+    }
+    
+    float t = (-ray.p.z)/(ray.dir.z);
+    if (t <= 0.001 || t >= t_max) {
+        return false;
+    }
+    
+    Point3 q = ray.p + ray.dir*t;
+    return q.x > -1 && q.x < 1 && q.y > -1 && q.y < 1;
+}
+
+//Bounding Box Intersection
+//Branchless slab test, the near and far plane of each axis are selected by the sign of the ray direction
+//Empty boxes and boxes behind the ray or beyond t_max are never hit
+bool Box::IntersectRay(const Ray &r, float t_max, float &tEntry) const {
+    const Point3* bounds[2] = {&pmin, &pmax};
+    float tExit = t_max;
+    tEntry = 0;
+    
+    for (int i = 0; i < 3; i++) {
+        float tNear = ((*bounds[r.sign[i]])[i] - r.p[i]) * r.invDir[i];
+        float tFar = ((*bounds[1 - r.sign[i]])[i] - r.p[i]) * r.invDir[i];
         
-        if (ty0 > ty1) {
-            float temp = ty1;
-            ty1 = ty0;
-            ty0 = temp;
-        }
-        if (tz0 > tz1) {
-            float temp = tz1;
-            tz1 = tz0;
-            tz0 = temp;
-        }
+        //Enlarge the exit slightly, so that rounding does not miss flat boxes or grazing rays
+        tFar *= 1.0000004f;
         
-        tEntry = std::max(tz0, ty0);
-        tExit = std::min(tz1, ty1);
-    }
-    else if (r.dir.y == 0) {
-        //Parallel to Y Plane
-        float tx0 = (allMin.x - r.p.x)/r.dir.x;
-        float tx1 = (allMax.x - r.p.x)/r.dir.x;
-        float tz0 = (allMin.z - r.p.z)/r.dir.z;
-        float tz1 = (allMax.z - r.p.z)/r.dir.z;
+        //Written so that a NaN (origin on the plane of a parallel axis) leaves the interval unchanged
+        tEntry = tNear > tEntry ? tNear : tEntry;
+        tExit = tFar < tExit ? tFar : tExit;
+    }
+    
+    return tEntry <= tExit;
+}
+
+//Conservative slab test of a ray packet, the same test with the plane distances bounded over all rays
+bool Box::IntersectPacket(const RayPacket &packet, float t_max, float &tEntry) const {
+    const Point3* bounds[2] = {&pmin, &pmax};
+    float tExit = t_max;
+    tEntry = 0;
+    
+    for (int i = 0; i < 3; i++) {
+        int s = packet.sign[i];
         
-        if (tx0 > tx1) {
-            float temp = tx1;
-            tx1 = tx0;
-            tx0 = temp;
-        }
-        if (tz0 > tz1) {
-            float temp = tz1;
-            tz1 = tz0;
-            tz0 = temp;
-        }
+        //The nearest plane distance comes from the origin farthest along the direction, and vice versa
+        float a = (*bounds[s])[i] - (s ? packet.originMin[i] : packet.originMax[i]);
+        float b = (*bounds[1 - s])[i] - (s ? packet.originMax[i] : packet.originMin[i]);
+        float a0 = a * packet.invDirMin[i], a1 = a * packet.invDirMax[i];
+        float b0 = b * packet.invDirMin[i], b1 = b * packet.invDirMax[i];
+        float tNear = a0 < a1 ? a0 : a1;
+        float tFar = (b0 > b1 ? b0 : b1) * 1.0000004f;
         
-        tEntry = std::max(tz0, tx0);
-        tExit = std::min(tz1, tx1);
-    }
-    else if (r.dir.z == 0) {
-        //Parallel to Z Plane
-        float tx0 = (allMin.x - r.p.x)/r.dir.x;
-        float tx1 = (allMax.x - r.p.x)/r.dir.x;
-        float ty0 = (allMin.y - r.p.y)/r.dir.y;
-        float ty1 = (allMax.y - r.p.y)/r.dir.y;
+        tEntry = tNear > tEntry ? tNear : tEntry;
+        tExit = tFar < tExit ? tFar : tExit;
+    }
+    
+    return tEntry <= tExit;
+}
+
+//Precompute the triangle data, in the element order of the BVH leaves
+//The leaves start at multiples of four elements, so each block belongs to a single leaf
+void TriObj::BuildTriangles()
+{
+    triangleBlocks.assign(bvh4.GetNumElements() / 4, TriangleBlock());
+    
+    for (unsigned int i = 0; i < bvh4.GetNumElements(); i++) {
+        TriangleBlock& block = triangleBlocks[i / 4];
+        int lane = i % 4;
+        unsigned int faceID = bvh4.GetElements(0)[i];
+        block.faceID[lane] = faceID;
         
-        if (tx0 > tx1) {
-            float temp = tx1;
-            tx1 = tx0;
-            tx0 = temp;
-        }
-        if (ty0 > ty1) {
-            float temp = ty1;
-            ty1 = ty0;
-            ty0 = temp;
+        if (faceID == cyBVH4::EMPTY_ELEMENT) {
+            for (int d = 0; d < 3; d++) {
+                block.v0[d][lane] = block.e1[d][lane] = block.e2[d][lane] = 0;
+            }
+            continue;
         }
         
-        tEntry = std::max(ty0, tx0);
-        tExit = std::min(ty1, tx1);
+        Point3 A = V(F(faceID).v[0]);
+        Point3 B = V(F(faceID).v[1]);
+        Point3 C = V(F(faceID).v[2]);
+        
+        for (int d = 0; d < 3; d++) {
+            block.v0[d][lane] = A[d];
+            block.e1[d][lane] = B[d] - A[d];
+            block.e2[d][lane] = C[d] - A[d];
+        }
     }
-    else {
-        //General Case
-        float tx0 = (allMin.x - r.p.x)/r.dir.x;
-        float tx1 = (allMax.x - r.p.x)/r.dir.x;
-        float ty0 = (allMin.y - r.p.y)/r.dir.y;
-        float ty1 = (allMax.y - r.p.y)/r.dir.y;
-        float tz0 = (allMin.z - r.p.z)/r.dir.z;
-        float tz1 = (allMax.z - r.p.z)/r.dir.z;
+}
+
+//Triangle Intersection
+//Moller-Trumbore test of four triangles at once, only finds the distance and the barycentric coordinates
+//of the second and third vertex of the closest triangle, returns its slot in the block or -1
+//The edges are included in the test, so that there are no cracks between neighboring triangles
+int TriObj::IntersectTriangles(const Ray &ray, const TriangleBlock &block, float tMax, float &t, float &u, float &v) const {
+    float tHit[4], uHit[4], vHit[4];
+    int hitMask = 0;
+    
+#ifdef _CY_BVH_SSE
+    __m128 dx = _mm_set1_ps(ray.dir.x), dy = _mm_set1_ps(ray.dir.y), dz = _mm_set1_ps(ray.dir.z);
+    __m128 e1x = _mm_load_ps(block.e1[0]), e1y = _mm_load_ps(block.e1[1]), e1z = _mm_load_ps(block.e1[2]);
+    __m128 e2x = _mm_load_ps(block.e2[0]), e2y = _mm_load_ps(block.e2[1]), e2z = _mm_load_ps(block.e2[2]);
+    
+    //pVec = dir x e2, det = e1 . pVec
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+    
+    //tVec = p - v0, u = tVec . pVec
+    __m128 tx = _mm_sub_ps(_mm_set1_ps(ray.p.x), _mm_load_ps(block.v0[0]));
+    __m128 ty = _mm_sub_ps(_mm_set1_ps(ray.p.y), _mm_load_ps(block.v0[1]));
+    __m128 tz = _mm_sub_ps(_mm_set1_ps(ray.p.z), _mm_load_ps(block.v0[2]));
+    __m128 bu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+    
+    //qVec = tVec x e1, v = dir . qVec, t = e2 . qVec
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+    __m128 bv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+    __m128 distance = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+    
+    //Parallel rays and empty slots have det = 0 and fail every comparison below
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    __m128 hit = _mm_cmpneq_ps(det, zero);
+    hit = _mm_and_ps(hit, _mm_cmpge_ps(bu, zero));
+    hit = _mm_and_ps(hit, _mm_cmpge_ps(bv, zero));
+    hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(bu, bv), one));
+    hit = _mm_and_ps(hit, _mm_cmpgt_ps(distance, _mm_set1_ps(0.00001f)));
+    hit = _mm_and_ps(hit, _mm_cmplt_ps(distance, _mm_set1_ps(tMax)));
+    hitMask = _mm_movemask_ps(hit);
+    
+    if (hitMask == 0) {
+        return -1;
+    }
+    
+    _mm_storeu_ps(tHit, distance);
+    _mm_storeu_ps(uHit, bu);
+    _mm_storeu_ps(vHit, bv);
+#else
+    for (int i = 0; i < 4; i++) {
+        const Point3& dir = ray.dir;
+        Point3 e1 = Point3(block.e1[0][i], block.e1[1][i], block.e1[2][i]);
+        Point3 e2 = Point3(block.e2[0][i], block.e2[1][i], block.e2[2][i]);
         
-        //Make sure Pt0 is smaller than Pt1
-        if (tx0 > tx1) {
-            float temp = tx1;
-            tx1 = tx0;
-            tx0 = temp;
+        Point3 pVec = dir.Cross(e2);
+        float det = e1.Dot(pVec);
+        if (det == 0) {
+            continue;
         }
-        if (ty0 > ty1) {
-            float temp = ty1;
-            ty1 = ty0;
-            ty0 = temp;
+        
+        float invDet = 1.0f / det;
+        Point3 tVec = ray.p - Point3(block.v0[0][i], block.v0[1][i], block.v0[2][i]);
+        uHit[i] = tVec.Dot(pVec) * invDet;
+        if (uHit[i] < 0 || uHit[i] > 1) {
+            continue;
         }
-        if (tz0 > tz1) {
-            float temp = tz1;
-            tz1 = tz0;
-            tz0 = temp;
+        
+        Point3 qVec = tVec.Cross(e1);
+        vHit[i] = dir.Dot(qVec) * invDet;
+        if (vHit[i] < 0 || uHit[i] + vHit[i] > 1) {
+            continue;
         }
         
-        //Compute Entry and Exit Point
-        tEntry = std::max(std::max(tx0, ty0), tz0);
-        tExit = std::min(std::min(tx1, ty1), tz1);
+        tHit[i] = e2.Dot(qVec) * invDet;
+        if (tHit[i] > 0.00001 && tHit[i] < tMax) {
+            hitMask |= 1 << i;
+        }
     }
-
-    if (tEntry <= tExit && tEntry < t_max) {
-        return true;
+#endif
+    
+    //Closest of the hit triangles, the first one wins a tie
+    int closest = -1;
+    for (int i = 0; i < 4; i++) {
+        if ((hitMask & (1 << i)) && (closest < 0 || tHit[i] < tHit[closest])) {
+            closest = i;
+        }
     }
-    else {
-        return false;
+    
+    if (closest >= 0) {
+        t = tHit[closest];
+        u = uHit[closest];
+        v = vHit[closest];
     }
+    return closest;
 }
 
-//Triangle Intersection
-bool TriObj::IntersectTriangle(const Ray &ray, HitInfo &hInfo, int hitSide, unsigned int faceID) const {
-    //Get the triangle
+//Fill in hitinfo for the closest triangle
+void TriObj::SetHitInfo(const Ray &ray, const HitRecord &hit, HitInfo &hInfo) const {
+    unsigned int faceID = hit.primitive;
+    Point3 bc = Point3(1 - hit.u - hit.v, hit.u, hit.v);
+    
+    //Front side if the ray goes against the winding order normal
     Point3 A = V(F(faceID).v[0]);
-    Point3 B = V(F(faceID).v[1]);
-    Point3 C = V(F(faceID).v[2]);
+    Point3 N = (V(F(faceID).v[1]) - A).Cross(V(F(faceID).v[2]) - A);
+    hInfo.front = ray.dir.Dot(N) < 0;
     
-    Point3 N = (B-A).Cross(C-A).GetNormalized();
+    hInfo.uvw = GetTexCoord(faceID, bc);
+    hInfo.N = GetNormal(faceID, bc).GetNormalized();
+    hInfo.z = hit.z;
+    hInfo.p = GetPoint(faceID, bc);
+}
+
+//Child of a BVH4 node waiting on the traversal stack
+struct BVHStackEntry
+{
+    unsigned int child;         //Node index, or element offset of a leaf
+    unsigned int elementCount;  //Zero for internal nodes
+    float tEntry;               //Distance where the ray enters the child box
+};
+
+bool TriObj::IntersectHit(const Ray &ray, HitRecord &hit, int hitSide) const
+{
+    if (bvh4.GetNumNodes() == 0) {
+        return false;
+    }
     
-    if (ray.dir.Dot(N) != 0) {
+    //Closest triangle so far
+    unsigned int closestFace = cyBVH4::EMPTY_ELEMENT;
+    float closestT = hit.z;
+    float closestU = 0;
+    float closestV = 0;
+    
+    //Reuse the stack memory of the thread between rays
+    static thread_local std::vector<BVHStackEntry> traceStack;
+    traceStack.clear();
+    traceStack.push_back({bvh4.GetRootNodeID(), 0, 0.0f});
+    
+    //Traverse the four-wide Bounding Volume Hierarchy
+    while (!traceStack.empty()) {
+        BVHStackEntry current = traceStack.back();
+        traceStack.pop_back();
         
-        float t = (A-ray.p).Dot(N) / ray.dir.Dot(N);
+        //Skip children that start behind the closest hit found so far
+        if (current.tEntry >= closestT) {
+            continue;
+        }
         
-        //Calculate BaryCentric Coordinates
-        if (t > 0.00001 && t < hInfo.z) {
-            Point3 q = ray.p + ray.dir*t;
+        //Intersect with leaf node, four triangles at a time
+        if (current.elementCount > 0) {
+            const TriangleBlock* blocks = &triangleBlocks[current.child / 4];
             
-            //Project triangle into 2D
-            float maxNormalAxis = std::max(std::max(fabsf(N.x), fabsf(N.y)), fabsf(N.z));
-            
-            Point2 ProjectedA, ProjectedB, ProjectedC, ProjectedQ;
-            
-            if (maxNormalAxis == fabsf(N.x)) {
-                ProjectedA = Point2(A.y, A.z);
-                ProjectedB = Point2(B.y, B.z);
-                ProjectedC = Point2(C.y, C.z);
-                ProjectedQ = Point2(q.y, q.z);
-            }
-            else if (maxNormalAxis == fabsf(N.y)) {
-                ProjectedA = Point2(A.x, A.z);
-                ProjectedB = Point2(B.x, B.z);
-                ProjectedC = Point2(C.x, C.z);
-                ProjectedQ = Point2(q.x, q.z);
+            for (unsigned int i = 0; i < (current.elementCount + 3) / 4; i++) {
+                int hit = IntersectTriangles(ray, blocks[i], closestT, closestT, closestU, closestV);
+                if (hit >= 0) {
+                    closestFace = blocks[i].faceID[hit];
+                }
             }
-            else if (maxNormalAxis == fabsf(N.z)) {
-                ProjectedA = Point2(A.x, A.y);
-                ProjectedB = Point2(B.x, B.y);
-                ProjectedC = Point2(C.x, C.y);
-                ProjectedQ = Point2(q.x, q.y);
+            continue;
+        }
+        
+        //Test the ray against the four child boxes at once
+        const cyBVH4::Node& node = bvh4.GetNode(current.child);
+        float tEntry[4];
+        int hitMask = cyBVH4::IntersectChildren(node, ray.p.Data(), ray.invDir.Data(), ray.sign, closestT, tEntry);
+        
+        //Sort the hit children from far to near, so that the nearest one is on top of the stack
+        BVHStackEntry hitChildren[4];
+        int hitCount = 0;
+        for (int i = 0; i < 4; i++) {
+            if (hitMask & (1 << i)) {
+                BVHStackEntry child = {node.child[i], node.elementCount[i], tEntry[i]};
+                int j = hitCount++;
+                while (j > 0 && hitChildren[j-1].tEntry < child.tEntry) {
+                    hitChildren[j] = hitChildren[j-1];
+                    j--;
+                }
+                hitChildren[j] = child;
             }
+        }
+        
+        for (int i = 0; i < hitCount; i++) {
+            traceStack.push_back(hitChildren[i]);
+        }
+    }
+    
+    if (closestFace == cyBVH4::EMPTY_ELEMENT) {
+        return false;
+    }
+    
+    hit.z = closestT;
+    hit.u = closestU;
+    hit.v = closestV;
+    hit.primitive = closestFace;
+    return true;
+}
+
+//Shadow Intersection
+//Any triangle closer than t_max blocks the ray, so the children are pushed without sorting
+//and the traversal returns at the first hit
+bool TriObj::IntersectShadow(const Ray &ray, float t_max) const
+{
+    if (bvh4.GetNumNodes() == 0) {
+        return false;
+    }
+    
+    static thread_local std::vector<BVHStackEntry> traceStack;
+    traceStack.clear();
+    traceStack.push_back({bvh4.GetRootNodeID(), 0, 0.0f});
+    
+    while (!traceStack.empty()) {
+        BVHStackEntry current = traceStack.back();
+        traceStack.pop_back();
+        
+        if (current.elementCount > 0) {
+            const TriangleBlock* blocks = &triangleBlocks[current.child / 4];
             
-            //Calculate BC based on area
-            float TriABCArea = (ProjectedC-ProjectedA).Cross(ProjectedB-ProjectedA)/2.0;
-            float TriAPCArea = (ProjectedC-ProjectedA).Cross(ProjectedQ-ProjectedA)/2.0;
-            float TriABPArea = (ProjectedQ-ProjectedA).Cross(ProjectedB-ProjectedA)/2.0;
-            
-            float BC1 = TriAPCArea/TriABCArea;
-            float BC2 = TriABPArea/TriABCArea;
-            float BC3 = 1.0 - BC1 - BC2;
-            
-            if (BC1 > 0 && BC2 > 0 && BC3 > 0 &&
-                BC1 < 1 && BC2 < 1 && BC3 < 1) {
-                Point3 bc = Point3(BC3, BC1, BC2);
-                
-                if (ray.dir.Dot(N) < 0) {
-                    hInfo.front = true;
-                }
-                else {
-                    hInfo.front = false;
+            for (unsigned int i = 0; i < (current.elementCount + 3) / 4; i++) {
+                float t, u, v;
+                if (IntersectTriangles(ray, blocks[i], t_max, t, u, v) >= 0) {
+                    return true;
                 }
-                
-                hInfo.uvw = GetTexCoord(faceID, bc);
-                hInfo.N = GetNormal(faceID, bc).GetNormalized();
-                hInfo.z = t;
-                hInfo.p = GetPoint(faceID, bc);
-                
-                return true;
+            }
+            continue;
+        }
+        
+        const cyBVH4::Node& node = bvh4.GetNode(current.child);
+        float tEntry[4];
+        int hitMask = cyBVH4::IntersectChildren(node, ray.p.Data(), ray.invDir.Data(), ray.sign, t_max, tEntry);
+        
+        for (int i = 0; i < 4; i++) {
+            if (hitMask & (1 << i)) {
+                traceStack.push_back({node.child[i], node.elementCount[i], tEntry[i]});
             }
         }
     }
@@ -327,196 +471,170 @@ bool TriObj::IntersectTriangle(const Ray &ray, HitInfo &hInfo, int hitSide, unsi
     return false;
 }
 
-//BVHBox Intersection for BVH traversal
-float BVHBoxIntersection(const Ray &r, Box bvhBox, float t_max);
-
-bool TriObj::IntersectRay(const Ray &ray, HitInfo &hInfo, int hitSide) const
+//Packet Intersection
+//The packet visits every node that one of its rays may hit, using a single interval test per node
+//Only the leaf triangles are tested ray by ray, each ray keeps its own closest hit
+int TriObj::IntersectPacket(const RayPacket &packet, HitRecord *hit, int hitSide) const
 {
-    bool hitResult = false;
+    if (bvh4.GetNumNodes() == 0) {
+        return 0;
+    }
+    
+    unsigned int closestFace[RayPacket::MAX_SIZE];
+    float closestT[RayPacket::MAX_SIZE], closestU[RayPacket::MAX_SIZE], closestV[RayPacket::MAX_SIZE];
+    float packetT = 0;
+    for (int r = 0; r < packet.size; r++) {
+        closestFace[r] = cyBVH4::EMPTY_ELEMENT;
+        closestT[r] = hit[r].z;
+        packetT = closestT[r] > packetT ? closestT[r] : packetT;
+    }
+    
+    static thread_local std::vector<BVHStackEntry> traceStack;
+    traceStack.clear();
+    traceStack.push_back({bvh4.GetRootNodeID(), 0, 0.0f});
     
-    if (GetBoundBox().IntersectRay(ray, BIGFLOAT)){
-        //Traverse Bounding Volume Hierarchy
-        static const int STACK_MAX = 100;
-        int stackTop = 0;
-        unsigned int BVHTraceStack[STACK_MAX] = {0};
+    while (!traceStack.empty()) {
+        BVHStackEntry current = traceStack.back();
+        traceStack.pop_back();
         
-        BVHTraceStack[stackTop] = bvh.GetRootNodeID();
+        //Skip children that start behind the closest hits of all rays
+        if (current.tEntry >= packetT) {
+            continue;
+        }
         
-        //Start iteration
-        while (stackTop >= 0) {
-            unsigned int currentNodeIndex = BVHTraceStack[stackTop];
-            stackTop--;
-
-            //If not a leaf node
-            //Check which child node is closer
-            if (!bvh.IsLeafNode(currentNodeIndex)) {
-                unsigned int firstChildIndex = bvh.GetFirstChildNode(currentNodeIndex);
-                unsigned int secondChildIndex = bvh.GetSecondChildNode(currentNodeIndex);
-                Box child1Box = Box(bvh.GetNodeBounds(firstChildIndex));
-                Box child2Box = Box(bvh.GetNodeBounds(secondChildIndex));
-
-                float child1TValue = BVHBoxIntersection(ray, child1Box, BIGFLOAT);
-                float child2TValue = BVHBoxIntersection(ray, child2Box, BIGFLOAT);
-
-                if (child1TValue <= child2TValue)
-                {
-                    if (child2TValue != BIGFLOAT)
-                    {
-                        stackTop++;
-                        BVHTraceStack[stackTop] = secondChildIndex;
-                    }
-
-                    if (child1TValue != BIGFLOAT)
-                    {
-                        stackTop++;
-                        BVHTraceStack[stackTop] = firstChildIndex;
-                    }
-                }
-
-                else if (child1TValue > child2TValue)
-                {
-                    if (child1TValue != BIGFLOAT)
-                    {
-                        stackTop++;
-                        BVHTraceStack[stackTop] = firstChildIndex;
-                    }
-
-                    if (child2TValue != BIGFLOAT)
-                    {
-                        stackTop++;
-                        BVHTraceStack[stackTop] = secondChildIndex;
+        if (current.elementCount > 0) {
+            const TriangleBlock* blocks = &triangleBlocks[current.child / 4];
+            
+            for (unsigned int i = 0; i < (current.elementCount + 3) / 4; i++) {
+                for (int r = 0; r < packet.size; r++) {
+                    int hit = IntersectTriangles(packet.ray[r], blocks[i], closestT[r], closestT[r], closestU[r], closestV[r]);
+                    if (hit >= 0) {
+                        closestFace[r] = blocks[i].faceID[hit];
                     }
                 }
             }
-            //Intersect with leaf node
-            else {
-                //Iterate through all faces
-                for (int i = 0; i < bvh.GetNodeElementCount(currentNodeIndex); i++) {
-                    hitResult |= IntersectTriangle(ray, hInfo, hitSide, bvh.GetNodeElements(currentNodeIndex)[i]);
+            
+            //The farthest closest hit bounds the rest of the traversal
+            packetT = 0;
+            for (int r = 0; r < packet.size; r++) {
+                packetT = closestT[r] > packetT ? closestT[r] : packetT;
+            }
+            continue;
+        }
+        
+        const cyBVH4::Node& node = bvh4.GetNode(current.child);
+        float tEntry[4];
+        int hitMask = cyBVH4::IntersectChildrenInterval(node, packet.originMin.Data(), packet.originMax.Data(),
+                                                         packet.invDirMin.Data(), packet.invDirMax.Data(),
+                                                         packet.sign, packetT, tEntry);
+        
+        //Sort the hit children from far to near by their lower entry bound
+        BVHStackEntry hitChildren[4];
+        int hitCount = 0;
+        for (int i = 0; i < 4; i++) {
+            if (hitMask & (1 << i)) {
+                BVHStackEntry child = {node.child[i], node.elementCount[i], tEntry[i]};
+                int j = hitCount++;
+                while (j > 0 && hitChildren[j-1].tEntry < child.tEntry) {
+                    hitChildren[j] = hitChildren[j-1];
+                    j--;
                 }
+                hitChildren[j] = child;
             }
         }
         
-        //Iterate through all faces
-       // for (int i = 0; i < NF(); i++) {
-       //     hitResult |= IntersectTriangle(ray, hInfo, hitSide, i);
-       // }
+        for (int i = 0; i < hitCount; i++) {
+            traceStack.push_back(hitChildren[i]);
+        }
     }
-    return hitResult;
+    
+    int result = 0;
+    for (int r = 0; r < packet.size; r++) {
+        if (closestFace[r] != cyBVH4::EMPTY_ELEMENT) {
+            hit[r].z = closestT[r];
+            hit[r].u = closestU[r];
+            hit[r].v = closestV[r];
+            hit[r].primitive = closestFace[r];
+            result |= 1 << r;
+        }
+    }
+    return result;
 }
 
-float BVHBoxIntersection(const Ray &r, Box bvhBox, float t_max) {
-    Point3 allMin = bvhBox.pmin;
-    Point3 allMax = bvhBox.pmax;
-    float tEntry;
-    float tExit;
-    
-    //Special Cases
-    if (bvhBox.IsEmpty()) {
-        return -t_max;
-    }
-    
-    if (r.dir.x == 0) {
-        //Parallel to X Plane
-        float ty0 = (allMin.y - r.p.y)/r.dir.y;
-        float ty1 = (allMax.y - r.p.y)/r.dir.y;
-        float tz0 = (allMin.z - r.p.z)/r.dir.z;
-        float tz1 = (allMax.z - r.p.z)/r.dir.z;
-        
-        //Make sure Pt0 is smaller than Pt1
-        if (ty0 > ty1) {
-            float temp = ty1;
-            ty1 = ty0;
-            ty0 = temp;
-        }
-        if (tz0 > tz1) {
-            float temp = tz1;
-            tz1 = tz0;
-            tz0 = temp;
+//Shadow Packet Intersection
+//Same interval traversal as IntersectPacket, but any triangle closer than t_max blocks a ray
+//A blocked ray leaves the packet, the traversal ends once every ray is blocked
+int TriObj::IntersectShadowPacket(const RayPacket &packet, const float *t_max, int activeMask) const
+{
+    int occludedMask = 0;
+    
+    if (bvh4.GetNumNodes() == 0) {
+        return occludedMask;
+    }
+    
+    //Farthest t_max of the rays left, nodes beyond it cannot block any of them
+    float packetT = 0;
+    for (int r = 0; r < packet.size; r++) {
+        if (activeMask & (1 << r)) {
+            packetT = t_max[r] > packetT ? t_max[r] : packetT;
         }
+    }
+    
+    static thread_local std::vector<BVHStackEntry> traceStack;
+    traceStack.clear();
+    traceStack.push_back({bvh4.GetRootNodeID(), 0, 0.0f});
+    
+    while (!traceStack.empty()) {
+        BVHStackEntry current = traceStack.back();
+        traceStack.pop_back();
         
-        tEntry = std::max(tz0, ty0);
-        tExit = std::min(tz1, ty1);
-    }
-    else if (r.dir.y == 0) {
-        //Parallel to Y Plane
-        float tx0 = (allMin.x - r.p.x)/r.dir.x;
-        float tx1 = (allMax.x - r.p.x)/r.dir.x;
-        float tz0 = (allMin.z - r.p.z)/r.dir.z;
-        float tz1 = (allMax.z - r.p.z)/r.dir.z;
-        
-        //Make sure Pt0 is smaller than Pt1
-        if (tx0 > tx1) {
-            float temp = tx1;
-            tx1 = tx0;
-            tx0 = temp;
+        if (current.tEntry >= packetT) {
+            continue;
         }
-        if (tz0 > tz1) {
-            float temp = tz1;
-            tz1 = tz0;
-            tz0 = temp;
-        }
-        
-        tEntry = std::max(tz0, tx0);
-        tExit = std::min(tz1, tx1);
-    }
-    else if (r.dir.z == 0) {
-        //Parallel to Z Plane
-        float tx0 = (allMin.x - r.p.x)/r.dir.x;
-        float tx1 = (allMax.x - r.p.x)/r.dir.x;
-        float ty0 = (allMin.y - r.p.y)/r.dir.y;
-        float ty1 = (allMax.y - r.p.y)/r.dir.y;
         
-        //Make sure Pt0 is smaller than Pt1
-        if (tx0 > tx1) {
-            float temp = tx1;
-            tx1 = tx0;
-            tx0 = temp;
-        }
-        if (ty0 > ty1) {
-            float temp = ty1;
-            ty1 = ty0;
-            ty0 = temp;
+        if (current.elementCount > 0) {
+            const TriangleBlock* blocks = &triangleBlocks[current.child / 4];
+            
+            for (int r = 0; r < packet.size; r++) {
+                if (!(activeMask & (1 << r))) {
+                    continue;
+                }
+                
+                for (unsigned int i = 0; i < (current.elementCount + 3) / 4; i++) {
+                    float t, u, v;
+                    if (IntersectTriangles(packet.ray[r], blocks[i], t_max[r], t, u, v) >= 0) {
+                        occludedMask |= 1 << r;
+                        activeMask &= ~(1 << r);
+                        break;
+                    }
+                }
+            }
+            
+            if (activeMask == 0) {
+                return occludedMask;
+            }
+            
+            packetT = 0;
+            for (int r = 0; r < packet.size; r++) {
+                if (activeMask & (1 << r)) {
+                    packetT = t_max[r] > packetT ? t_max[r] : packetT;
+                }
+            }
+            continue;
         }
         
-        tEntry = std::max(ty0, tx0);
-        tExit = std::min(ty1, tx1);
-    }
-    else {
-        //General Case
-        float tx0 = (allMin.x - r.p.x)/r.dir.x;
-        float tx1 = (allMax.x - r.p.x)/r.dir.x;
-        float ty0 = (allMin.y - r.p.y)/r.dir.y;
-        float ty1 = (allMax.y - r.p.y)/r.dir.y;
-        float tz0 = (allMin.z - r.p.z)/r.dir.z;
-        float tz1 = (allMax.z - r.p.z)/r.dir.z;
+        const cyBVH4::Node& node = bvh4.GetNode(current.child);
+        float tEntry[4];
+        int hitMask = cyBVH4::IntersectChildrenInterval(node, packet.originMin.Data(), packet.originMax.Data(),
+                                                         packet.invDirMin.Data(), packet.invDirMax.Data(),
+                                                         packet.sign, packetT, tEntry);
         
-        //Make sure Pt0 is smaller than Pt1
-        if (tx0 > tx1) {
-            float temp = tx1;
-            tx1 = tx0;
-            tx0 = temp;
-        }
-        if (ty0 > ty1) {
-            float temp = ty1;
-            ty1 = ty0;
-            ty0 = temp;
-        }
-        if (tz0 > tz1) {
-            float temp = tz1;
-            tz1 = tz0;
-            tz0 = temp;
+        for (int i = 0; i < 4; i++) {
+            if (hitMask & (1 << i)) {
+                traceStack.push_back({node.child[i], node.elementCount[i], tEntry[i]});
+            }
         }
-        
-        //Compute Entry and Exit Point
-        tEntry = std::max(std::max(tx0, ty0), tz0);
-        tExit = std::min(std::min(tx1, ty1), tz1);
     }
     
-    if (tEntry <= tExit && tEntry < t_max) {
-        return tEntry + 0.01;
-    }
-    else {
-        return t_max;
-    }
+    return occludedMask;
 }